@@ -485,6 +485,17 @@ static char *console_kit_check_active_session_change(struct session_info *info)
     return info->active_session;
 }
 
+/* Our signals arrive on the fd from session_info_get_fd, they get read
+   when the active session is checked */
+int session_info_get_signal_fd(struct session_info *info)
+{
+    return -1;
+}
+
+void session_info_handle_signals(struct session_info *info)
+{
+}
+
 gboolean session_info_session_is_locked(struct session_info *info)
 {
     gboolean locked;
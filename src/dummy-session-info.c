@@ -45,7 +45,16 @@ char *session_info_session_for_pid(struct session_info *si, uint32_t pid)
     return NULL;
 }
 
-gboolean session_is_locked(struct session_info *ck)
+int session_info_get_signal_fd(struct session_info *si)
+{
+    return -1;
+}
+
+void session_info_handle_signals(struct session_info *si)
+{
+}
+
+gboolean session_info_session_is_locked(struct session_info *si)
 {
     return FALSE;
 }
@@ -37,6 +37,13 @@ const char *session_info_get_active_session(struct session_info *ck);
 /* Note result must be free()-ed by caller */
 char *session_info_session_for_pid(struct session_info *ck, uint32_t pid);
 
+/* Session state such as the lock state may be tracked through signals
+   arriving on a separate fd, which must be watched for reading too, and
+   session_info_handle_signals called when it becomes readable. Returns -1
+   when there is no such fd. */
+int session_info_get_signal_fd(struct session_info *si);
+void session_info_handle_signals(struct session_info *si);
+
 gboolean session_info_session_is_locked(struct session_info *si);
 gboolean session_info_is_user(struct session_info *si);
 
@@ -33,7 +33,11 @@ struct session_info {
     char *session;
     struct {
         DBusConnection *system_connection;
+        int fd;
         char *match_session_signals;
+        char *match_properties_signals;
+        /* serial of our LockedHint Properties.Get call, 0 if none pending */
+        dbus_uint32_t locked_hint_serial;
     } dbus;
     gboolean session_is_locked;
     gboolean session_locked_hint;
@@ -51,6 +55,8 @@ struct session_info {
 
 #define SESSION_PROP_LOCKED_HINT    "LockedHint"
 
+#define PROPERTIES_SIGNAL_CHANGED   "PropertiesChanged"
+
 /* dbus related */
 static DBusConnection *si_dbus_get_system_bus(void)
 {
@@ -72,65 +78,81 @@ static DBusConnection *si_dbus_get_system_bus(void)
     return connection;
 }
 
-static void si_dbus_match_remove(struct session_info *si)
+static void si_dbus_remove_match(struct session_info *si, char **match)
 {
     DBusError error;
-    if (si->dbus.match_session_signals == NULL)
+    if (*match == NULL)
         return;
 
     dbus_error_init(&error);
-    dbus_bus_remove_match(si->dbus.system_connection,
-                          si->dbus.match_session_signals,
-                          &error);
+    dbus_bus_remove_match(si->dbus.system_connection, *match, &error);
+    if (dbus_error_is_set(&error))
+        dbus_error_free(&error);
 
-    g_free(si->dbus.match_session_signals);
-    si->dbus.match_session_signals = NULL;
+    g_free(*match);
+    *match = NULL;
 }
 
-static void si_dbus_match_rule_update(struct session_info *si)
+static void si_dbus_match_remove(struct session_info *si)
 {
-    DBusError error;
-
-    if (si->dbus.system_connection == NULL ||
-            si->session == NULL)
-        return;
+    si_dbus_remove_match(si, &si->dbus.match_session_signals);
+    si_dbus_remove_match(si, &si->dbus.match_properties_signals);
+}
 
-    si_dbus_match_remove(si);
+/* Returns match if it got added, NULL otherwise */
+static char *si_dbus_add_match(struct session_info *si, char *match)
+{
+    DBusError error;
 
-    si->dbus.match_session_signals =
-        g_strdup_printf ("type='signal',interface='%s',path='"
-                         LOGIND_SESSION_OBJ_TEMPLATE"'",
-                         LOGIND_SESSION_INTERFACE,
-                         si->session);
     if (si->verbose)
-        syslog(LOG_DEBUG, "logind match: %s", si->dbus.match_session_signals);
+        syslog(LOG_DEBUG, "logind match: %s", match);
 
     dbus_error_init(&error);
-    dbus_bus_add_match(si->dbus.system_connection,
-                       si->dbus.match_session_signals,
-                       &error);
+    dbus_bus_add_match(si->dbus.system_connection, match, &error);
     if (dbus_error_is_set(&error)) {
         syslog(LOG_WARNING, "Unable to add dbus rule match: %s",
                error.message);
         dbus_error_free(&error);
-        g_free(si->dbus.match_session_signals);
-        si->dbus.match_session_signals = NULL;
+        g_free(match);
+        return NULL;
     }
+    return match;
 }
 
+static void si_dbus_match_rule_update(struct session_info *si)
+{
+    if (si->dbus.system_connection == NULL)
+        return;
+
+    si_dbus_match_remove(si);
+    if (si->session == NULL)
+        return;
+
+    si->dbus.match_session_signals = si_dbus_add_match(si,
+        g_strdup_printf ("type='signal',interface='%s',path='"
+                         LOGIND_SESSION_OBJ_TEMPLATE"'",
+                         LOGIND_SESSION_INTERFACE,
+                         si->session));
+    si->dbus.match_properties_signals = si_dbus_add_match(si,
+        g_strdup_printf ("type='signal',interface='%s',member='%s',path='"
+                         LOGIND_SESSION_OBJ_TEMPLATE"'",
+                         DBUS_PROPERTIES_INTERFACE,
+                         PROPERTIES_SIGNAL_CHANGED,
+                         si->session));
+}
+
+/* Ask for the current LockedHint, the reply gets handled along with the
+   signals, see si_dbus_read_signals */
 static void
-si_dbus_read_properties(struct session_info *si)
+si_dbus_request_locked_hint(struct session_info *si)
 {
-    dbus_bool_t locked_hint, ret;
-    DBusMessageIter iter, iter_variant;
-    gint type;
-    DBusError error;
+    dbus_bool_t ret;
     DBusMessage *message = NULL;
-    DBusMessage *reply = NULL;
     gchar *session_object;
     const gchar *interface, *property;
 
-    if (si->session == NULL)
+    si->dbus.locked_hint_serial = 0;
+    if (si->dbus.system_connection == NULL || si->session == NULL)
         return;
 
     session_object = g_strdup_printf(LOGIND_SESSION_OBJ_TEMPLATE, si->session);
@@ -155,44 +177,107 @@ si_dbus_read_properties(struct session_info *si)
         goto exit;
     }
 
-    dbus_error_init(&error);
-    reply = dbus_connection_send_with_reply_and_block(si->dbus.system_connection,
-                                                      message,
-                                                      -1,
-                                                      &error);
-    if (reply == NULL) {
-        if (dbus_error_is_set(&error)) {
-            syslog(LOG_ERR, "Properties.Get failed (locked-hint) due %s", error.message);
-            dbus_error_free(&error);
-        } else {
-            syslog(LOG_ERR, "Properties.Get failed (locked-hint)");
-        }
+    if (!dbus_connection_send(si->dbus.system_connection, message,
+                              &si->dbus.locked_hint_serial)) {
+        syslog(LOG_ERR, "Properties.Get failed (locked-hint)");
+        si->dbus.locked_hint_serial = 0;
         goto exit;
     }
+    dbus_connection_flush(si->dbus.system_connection);
+
+exit:
+    if (message != NULL) {
+        dbus_message_unref(message);
+    }
+}
+
+/* iter points to the variant holding the LockedHint value */
+static void
+si_dbus_read_locked_hint(struct session_info *si, DBusMessageIter *iter)
+{
+    DBusMessageIter iter_variant;
+    dbus_bool_t locked_hint;
+    gint type;
 
-    dbus_message_iter_init(reply, &iter);
-    type = dbus_message_iter_get_arg_type(&iter);
+    type = dbus_message_iter_get_arg_type(iter);
     if (type != DBUS_TYPE_VARIANT) {
         syslog(LOG_ERR, "expected a variant, got a '%c' instead", type);
-        goto exit;
+        return;
     }
 
-    dbus_message_iter_recurse(&iter, &iter_variant);
+    dbus_message_iter_recurse(iter, &iter_variant);
     type = dbus_message_iter_get_arg_type(&iter_variant);
     if (type != DBUS_TYPE_BOOLEAN) {
         syslog(LOG_ERR, "expected a boolean, got a '%c' instead", type);
-        goto exit;
+        return;
     }
     dbus_message_iter_get_basic(&iter_variant, &locked_hint);
 
     si->session_locked_hint = (locked_hint) ? TRUE : FALSE;
-exit:
-    if (reply != NULL) {
-        dbus_message_unref(reply);
+    if (si->verbose)
+        syslog(LOG_DEBUG, "(systemd-login) locked-hint: %s",
+               locked_hint ? "yes" : "no");
+}
+
+static void
+si_dbus_handle_locked_hint_reply(struct session_info *si,
+                                 DBusMessage *message)
+{
+    DBusMessageIter iter;
+
+    si->dbus.locked_hint_serial = 0;
+    if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_ERROR) {
+        syslog(LOG_ERR, "Properties.Get failed (locked-hint) due %s",
+               dbus_message_get_error_name(message));
+        return;
     }
 
-    if (message != NULL) {
-        dbus_message_unref(message);
+    if (!dbus_message_iter_init(message, &iter)) {
+        syslog(LOG_ERR, "Properties.Get (locked-hint) returned no value");
+        return;
+    }
+    si_dbus_read_locked_hint(si, &iter);
+}
+
+/* PropertiesChanged has the interface, a dict of changed properties with
+   their values and an array of invalidated properties without values */
+static void
+si_dbus_handle_properties_changed(struct session_info *si,
+                                  DBusMessage *message)
+{
+    DBusMessageIter iter, iter_array, iter_entry;
+    const gchar *interface, *property;
+
+    if (!dbus_message_iter_init(message, &iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return;
+    dbus_message_iter_get_basic(&iter, &interface);
+    if (g_strcmp0(interface, LOGIND_SESSION_INTERFACE) != 0)
+        return;
+
+    if (!dbus_message_iter_next(&iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return;
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) ==
+               DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(&iter_array, &iter_entry);
+        dbus_message_iter_get_basic(&iter_entry, &property);
+        if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0 &&
+                dbus_message_iter_next(&iter_entry))
+            si_dbus_read_locked_hint(si, &iter_entry);
+        dbus_message_iter_next(&iter_array);
+    }
+
+    if (!dbus_message_iter_next(&iter) ||
+            dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return;
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) == DBUS_TYPE_STRING) {
+        dbus_message_iter_get_basic(&iter_array, &property);
+        if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0)
+            si_dbus_request_locked_hint(si);
+        dbus_message_iter_next(&iter_array);
     }
 }
 
@@ -201,13 +286,30 @@ si_dbus_read_signals(struct session_info *si)
 {
     DBusMessage *message = NULL;
 
-    dbus_connection_read_write(si->dbus.system_connection, 0);
+    if (si->dbus.system_connection == NULL)
+        return;
+
+    if (!dbus_connection_read_write(si->dbus.system_connection, 0)) {
+        /* Stop watching the fd, it stays readable once disconnected */
+        syslog(LOG_WARNING, "(systemd-login) lost system bus connection");
+        si->dbus.fd = -1;
+    }
     message = dbus_connection_pop_message(si->dbus.system_connection);
     while (message != NULL) {
         const char *member;
+        int type = dbus_message_get_type(message);
 
         member = dbus_message_get_member (message);
-        if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
+        if ((type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+                 type == DBUS_MESSAGE_TYPE_ERROR) &&
+                si->dbus.locked_hint_serial != 0 &&
+                dbus_message_get_reply_serial(message) ==
+                    si->dbus.locked_hint_serial) {
+            si_dbus_handle_locked_hint_reply(si, message);
+        } else if (type == DBUS_MESSAGE_TYPE_SIGNAL &&
+                   g_strcmp0(member, PROPERTIES_SIGNAL_CHANGED) == 0) {
+            si_dbus_handle_properties_changed(si, message);
+        } else if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
             si->session_is_locked = TRUE;
         } else if (g_strcmp0(member, SESSION_SIGNAL_UNLOCK) == 0) {
             si->session_is_locked = FALSE;
@@ -220,7 +322,6 @@ si_dbus_read_signals(struct session_info *si)
         }
 
         dbus_message_unref(message);
-        dbus_connection_read_write(si->dbus.system_connection, 0);
         message = dbus_connection_pop_message(si->dbus.system_connection);
     }
 }
@@ -244,7 +345,14 @@ struct session_info *session_info_create(int verbose)
         return NULL;
     }
 
+    si->dbus.fd = -1;
     si->dbus.system_connection = si_dbus_get_system_bus();
+    if (si->dbus.system_connection &&
+            !dbus_connection_get_unix_fd(si->dbus.system_connection,
+                                         &si->dbus.fd)) {
+        syslog(LOG_WARNING, "Unable to get system bus connection fd");
+        si->dbus.fd = -1;
+    }
     return si;
 }
 
@@ -253,8 +361,11 @@ void session_info_destroy(struct session_info *si)
     if (!si)
         return;
 
-    si_dbus_match_remove(si);
-    dbus_connection_close(si->dbus.system_connection);
+    if (si->dbus.system_connection) {
+        si_dbus_match_remove(si);
+        dbus_connection_close(si->dbus.system_connection);
+        dbus_connection_unref(si->dbus.system_connection);
+    }
     sd_login_monitor_unref(si->mon);
     free(si->session);
     free(si);
@@ -282,9 +393,18 @@ const char *session_info_get_active_session(struct session_info *si)
         syslog(LOG_INFO, "Active session: %s", si->session);
 
     sd_login_monitor_flush(si->mon);
+
+    /* Start tracking the lock state of the new session */
+    if (g_strcmp0(old_session, si->session) != 0) {
+        si->session_is_locked = FALSE;
+        si->session_locked_hint = FALSE;
+        si_dbus_match_rule_update(si);
+        si_dbus_request_locked_hint(si);
+        /* Adding the matches may have queued up messages already */
+        si_dbus_read_signals(si);
+    }
     free(old_session);
 
-    si_dbus_match_rule_update(si);
     return si->session;
 }
 
@@ -303,15 +423,23 @@ char *session_info_session_for_pid(struct session_info *si, uint32_t pid)
     return session;
 }
 
+int session_info_get_signal_fd(struct session_info *si)
+{
+    return si->dbus.fd;
+}
+
+void session_info_handle_signals(struct session_info *si)
+{
+    si_dbus_read_signals(si);
+}
+
 gboolean session_info_session_is_locked(struct session_info *si)
 {
     gboolean locked;
 
     g_return_val_if_fail (si != NULL, FALSE);
 
-    si_dbus_read_signals(si);
-    si_dbus_read_properties(si);
-
+    /* The lock state is kept up to date from the signals we receive */
     locked = (si->session_is_locked || si->session_locked_hint);
     if (si->verbose) {
         syslog(LOG_DEBUG, "(systemd-login) session is locked: %s",
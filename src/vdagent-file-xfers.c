@@ -26,25 +26,81 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <spice/vd_agent.h>
 #include <glib.h>
 
 #include "vdagentd-proto.h"
 #include "vdagent-file-xfers.h"
 
+/* Guest -> client xfers are sent in data messages of this size, with at
+   most FILE_XFER_SEND_WINDOW of them queued up between us and the client */
+#define FILE_XFER_SEND_CHUNK_SIZE 65536
+#define FILE_XFER_SEND_WINDOW 8
+/* How long the client gets to accept a file we want to send, in us */
+#define FILE_XFER_SEND_START_TIMEOUT (30 * G_USEC_PER_SEC)
+
+typedef struct AgentFileXferSendTask {
+    uint32_t                       id;
+    int                            file_fd;
+    char                           *file_name;
+    uint64_t                       file_size;
+    uint64_t                       sent_bytes;
+    int                            can_send;
+    gint64                         start_timeout; /* monotonic, until
+                                                     can_send */
+} AgentFileXferSendTask;
+
+/* Cached state of a directory files get saved to: an open fd to create
+   files relative to, and the names in it, so that finding a free name
+   does not take a stat() per candidate. The names get re-read when the
+   directory's mtime shows that someone else has changed it */
+/* At most this many directories are kept open, when more are needed all
+   are closed, the client names a new subdir for each dir it sends */
+#define FILE_XFER_MAX_DIRS 16
+
+typedef struct AgentFileXferDir {
+    int                            fd;
+    GHashTable                     *names;
+    struct timespec                mtime;
+} AgentFileXferDir;
+
 struct vdagent_file_xfers {
     GHashTable *xfers;
+    GHashTable *dirs;
     struct udscs_connection *vdagentd;
     char *save_dir;
     int open_save_dir;
     int debug;
+
+    /* Status messages are queued up and sent to vdagentd in one go by
+       vdagent_file_xfers_flush(), which also opens the save dir if
+       open_save_dir_pending got set */
+    GArray *pending_status;
+    int open_save_dir_pending;
+    /* pids of the xdg-open-s we started, which still need to be reaped */
+    GArray *children;
+
+    /* Guest -> client xfers, files written to send_dir get queued in
+       send_queue and are then sent one at a time */
+    char *send_dir;
+    int inotify_fd;
+    GQueue *send_queue;
+    AgentFileXferSendTask *send_task;
+    uint32_t send_id;
+    int send_in_flight;
+    uint8_t *send_buf;
 };
 
 typedef struct AgentFileXferTask {
@@ -55,6 +111,8 @@ typedef struct AgentFileXferTask {
     uint64_t                       file_size;
     int                            file_xfer_nr;
     int                            file_xfer_total;
+    GChecksum                      *checksum;
+    char                           expected_checksum[65];
     int                            debug;
 } AgentFileXferTask;
 
@@ -73,36 +131,120 @@ static void vdagent_file_xfer_task_free(gpointer data)
         syslog(LOG_DEBUG, "file-xfer: Removing task %u %s",
                task->id, task->file_name);
 
+    if (task->checksum)
+        g_checksum_free(task->checksum);
+    g_free(task->file_name);
+    g_free(task);
+}
+
+static void vdagent_file_xfer_dir_free(gpointer data)
+{
+    AgentFileXferDir *dir = data;
+
+    close(dir->fd);
+    g_hash_table_destroy(dir->names);
+    g_free(dir);
+}
+
+static void vdagent_file_xfer_send_task_free(AgentFileXferSendTask *task)
+{
+    if (task->file_fd != -1)
+        close(task->file_fd);
     g_free(task->file_name);
     g_free(task);
 }
 
 struct vdagent_file_xfers *vdagent_file_xfers_create(
     struct udscs_connection *vdagentd, const char *save_dir,
-    int open_save_dir, int debug)
+    int open_save_dir, const char *send_dir, int debug)
 {
     struct vdagent_file_xfers *xfers;
 
-    xfers = g_malloc(sizeof(*xfers));
+    xfers = g_malloc0(sizeof(*xfers));
     xfers->xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
                                          NULL, vdagent_file_xfer_task_free);
+    xfers->dirs = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                        g_free, vdagent_file_xfer_dir_free);
     xfers->vdagentd = vdagentd;
     xfers->save_dir = g_strdup(save_dir);
     xfers->open_save_dir = open_save_dir;
     xfers->debug = debug;
+    xfers->pending_status = g_array_new(FALSE, FALSE,
+                                        sizeof(VDAgentFileXferStatusMessage));
+    xfers->children = g_array_new(FALSE, FALSE, sizeof(pid_t));
+
+    xfers->inotify_fd = -1;
+    xfers->send_queue = g_queue_new();
+    if (send_dir) {
+        xfers->send_dir = g_strdup(send_dir);
+        xfers->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (xfers->inotify_fd == -1 ||
+                inotify_add_watch(xfers->inotify_fd, send_dir,
+                                  IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+            syslog(LOG_ERR, "file-xfer: can not watch send dir %s: %s",
+                   send_dir, strerror(errno));
+            if (xfers->inotify_fd != -1)
+                close(xfers->inotify_fd);
+            xfers->inotify_fd = -1;
+        }
+    }
 
     return xfers;
 }
 
-void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfers)
+/* Reap the xdg-open-s we started which have exited, without touching any
+   other children of the process */
+static void vdagent_file_xfers_reap_children(struct vdagent_file_xfers *xfers)
+{
+    guint i = 0;
+    pid_t pid;
+
+    while (i < xfers->children->len) {
+        pid = g_array_index(xfers->children, pid_t, i);
+        if (waitpid(pid, NULL, WNOHANG) == 0)
+            i++;
+        else
+            g_array_remove_index_fast(xfers->children, i);
+    }
+}
+
+void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfers,
+    int vdagentd_disconnected)
 {
     g_return_if_fail(xfers != NULL);
 
+    /* Statuses queued in this main loop iteration, such as the final one of
+       a task, must not get lost */
+    if (!vdagentd_disconnected)
+        vdagent_file_xfers_flush(xfers);
+
     g_hash_table_destroy(xfers->xfers);
+    g_hash_table_destroy(xfers->dirs);
+    g_array_free(xfers->pending_status, TRUE);
+    vdagent_file_xfers_reap_children(xfers);
+    g_array_free(xfers->children, TRUE);
+    if (xfers->send_task)
+        vdagent_file_xfer_send_task_free(xfers->send_task);
+    g_queue_free_full(xfers->send_queue, g_free);
+    if (xfers->inotify_fd != -1)
+        close(xfers->inotify_fd);
+    g_free(xfers->send_buf);
+    g_free(xfers->send_dir);
     g_free(xfers->save_dir);
     g_free(xfers);
 }
 
+static void vdagent_file_xfers_queue_status(struct vdagent_file_xfers *xfers,
+    uint32_t id, uint32_t result)
+{
+    VDAgentFileXferStatusMessage status = {
+        .id = id,
+        .result = result,
+    };
+
+    g_array_append_val(xfers->pending_status, status);
+}
+
 static AgentFileXferTask *vdagent_file_xfers_get_task(
     struct vdagent_file_xfers *xfers, uint32_t id)
 {
@@ -117,64 +259,317 @@ static AgentFileXferTask *vdagent_file_xfers_get_task(
     return task;
 }
 
-/* Parse start message then create a new file xfer task */
-static AgentFileXferTask *vdagent_parse_start_msg(
-    VDAgentFileXferStartMessage *msg)
+/* Copy a keyfile string value, undoing the keyfile escaping. Like
+   g_key_file_get_string this fails, returning NULL, on invalid escapes
+   and on values which are not valid UTF-8 */
+static char *vdagent_parse_string(const char *value, size_t len)
 {
-    GKeyFile *keyfile = NULL;
-    AgentFileXferTask *task = NULL;
-    GError *error = NULL;
-
-    keyfile = g_key_file_new();
-    if (g_key_file_load_from_data(keyfile,
-                                  (const gchar *)msg->data,
-                                  -1,
-                                  G_KEY_FILE_NONE, &error) == FALSE) {
-        syslog(LOG_ERR, "file-xfer: failed to load keyfile: %s",
-               error->message);
+    char *str, *q;
+    size_t i;
+
+    str = q = g_malloc(len + 1);
+    for (i = 0; i < len; i++) {
+        if (value[i] != '\\') {
+            *q++ = value[i];
+            continue;
+        }
+        if (++i == len)
+            goto error;
+        switch (value[i]) {
+        case 's':  *q++ = ' ';  break;
+        case 'n':  *q++ = '\n'; break;
+        case 't':  *q++ = '\t'; break;
+        case 'r':  *q++ = '\r'; break;
+        case '\\': *q++ = '\\'; break;
+        default:
+            goto error;
+        }
+    }
+    *q = '\0';
+    if (!g_utf8_validate(str, q - str, NULL))
         goto error;
+    return str;
+
+error:
+    g_free(str);
+    return NULL;
+}
+
+static int vdagent_parse_uint64(const char *value, size_t len, uint64_t *ret)
+{
+    uint64_t v = 0;
+    size_t i;
+
+    if (len == 0)
+        return -1;
+    for (i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9' || v > (UINT64_MAX - 9) / 10)
+            return -1;
+        v = v * 10 + (value[i] - '0');
     }
+    *ret = v;
+    return 0;
+}
+
+static int vdagent_parse_int(const char *value, size_t len)
+{
+    int negative = (len && value[0] == '-');
+    uint64_t v;
+
+    if (vdagent_parse_uint64(value + negative, len - negative, &v) ||
+            v > INT_MAX)
+        return 0;
+    return negative ? -(int)v : (int)v;
+}
+
+#define KEY_IS(key, key_len, name) \
+    ((key_len) == sizeof(name) - 1 && memcmp((key), (name), (key_len)) == 0)
+
+/* Parse start message then create a new file xfer task. The message is a
+   keyfile, this does a single pass over it picking out the keys we know
+   about from the vdagent-file-xfer group, without building a GKeyFile */
+static AgentFileXferTask *vdagent_parse_start_msg(
+    VDAgentFileXferStartMessage *msg)
+{
+    AgentFileXferTask *task;
+    const char *line, *line_end, *key_end, *value;
+    size_t key_len, value_len;
+    int in_group = 0, have_size = 0;
+
     task = g_new0(AgentFileXferTask, 1);
     task->id = msg->id;
-    task->file_name = g_key_file_get_string(
-        keyfile, "vdagent-file-xfer", "name", &error);
-    if (error) {
-        syslog(LOG_ERR, "file-xfer: failed to parse filename: %s",
-               error->message);
+
+    for (line = (const char *)msg->data; *line; line = line_end) {
+        line_end = strchr(line, '\n');
+        if (line_end == NULL)
+            line_end = line + strlen(line);
+
+        while (line < line_end && g_ascii_isspace(*line))
+            line++;
+        value_len = line_end - line;
+        if (value_len && line[value_len - 1] == '\r')
+            value_len--;
+        if (*line_end)
+            line_end++;
+
+        if (value_len == 0 || line[0] == '#')
+            continue;
+
+        if (line[0] == '[') {
+            in_group = KEY_IS(line, value_len, "[vdagent-file-xfer]");
+            continue;
+        }
+        if (!in_group)
+            continue;
+
+        value = memchr(line, '=', value_len);
+        if (value == NULL) {
+            syslog(LOG_ERR, "file-xfer: failed to load keyfile: "
+                   "line without '='");
+            goto error;
+        }
+        key_end = value++;
+        while (key_end > line && g_ascii_isspace(key_end[-1]))
+            key_end--;
+        key_len = key_end - line;
+        value_len -= value - line;
+        while (value_len && g_ascii_isspace(*value)) {
+            value++;
+            value_len--;
+        }
+
+        if (KEY_IS(line, key_len, "name")) {
+            g_free(task->file_name);
+            task->file_name = vdagent_parse_string(value, value_len);
+            if (task->file_name == NULL) {
+                syslog(LOG_ERR, "file-xfer: failed to parse filename: "
+                       "invalid escape or not UTF-8");
+                goto error;
+            }
+        } else if (KEY_IS(line, key_len, "size")) {
+            if (vdagent_parse_uint64(value, value_len, &task->file_size)) {
+                syslog(LOG_ERR, "file-xfer: failed to parse filesize: %.*s",
+                       (int)value_len, value);
+                goto error;
+            }
+            have_size = 1;
+        /* These are set for xfers which are part of a multi-file xfer */
+        } else if (KEY_IS(line, key_len, "file-xfer-nr")) {
+            task->file_xfer_nr = vdagent_parse_int(value, value_len);
+        } else if (KEY_IS(line, key_len, "file-xfer-total")) {
+            task->file_xfer_total = vdagent_parse_int(value, value_len);
+        /* Optional hex encoded SHA-256 of the file contents, when present the
+           data gets hashed while it is being written and verified at the end */
+        } else if (KEY_IS(line, key_len, "sha256")) {
+            if (value_len != sizeof(task->expected_checksum) - 1) {
+                syslog(LOG_ERR, "file-xfer: invalid sha256: %.*s",
+                       (int)value_len, value);
+                goto error;
+            }
+            memcpy(task->expected_checksum, value, value_len);
+            task->expected_checksum[value_len] = '\0';
+        }
+    }
+
+    if (task->file_name == NULL) {
+        syslog(LOG_ERR, "file-xfer: failed to parse filename: missing name");
         goto error;
     }
-    task->file_size = g_key_file_get_uint64(
-        keyfile, "vdagent-file-xfer", "size", &error);
-    if (error) {
-        syslog(LOG_ERR, "file-xfer: failed to parse filesize: %s",
-               error->message);
+    if (!have_size) {
+        syslog(LOG_ERR, "file-xfer: failed to parse filesize: missing size");
         goto error;
     }
-    /* These are set for xfers which are part of a multi-file xfer */
-    task->file_xfer_nr = g_key_file_get_integer(
-        keyfile, "vdagent-file-xfer", "file-xfer-nr", NULL);
-    task->file_xfer_total = g_key_file_get_integer(
-        keyfile, "vdagent-file-xfer", "file-xfer-total", NULL);
+    if (task->expected_checksum[0])
+        task->checksum = g_checksum_new(G_CHECKSUM_SHA256);
 
-    g_key_file_free(keyfile);
     return task;
 
 error:
-    g_clear_error(&error);
-    if (task)
-        vdagent_file_xfer_task_free(task);
-    if (keyfile)
-        g_key_file_free(keyfile);
+    vdagent_file_xfer_task_free(task);
     return NULL;
 }
 
+static int vdagent_file_xfer_dir_scan(AgentFileXferDir *dir)
+{
+    struct dirent *entry;
+    struct stat st;
+    DIR *d;
+    int fd;
+
+    if (fstat(dir->fd, &st) == -1)
+        return -1;
+    if (dir->names && st.st_mtim.tv_sec == dir->mtime.tv_sec &&
+            st.st_mtim.tv_nsec == dir->mtime.tv_nsec)
+        return 0;
+
+    fd = dup(dir->fd);
+    if (fd == -1)
+        return -1;
+    d = fdopendir(fd);
+    if (d == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    if (dir->names)
+        g_hash_table_remove_all(dir->names);
+    else
+        dir->names = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, NULL);
+    rewinddir(d);
+    while ((entry = readdir(d)) != NULL) {
+        char *name = g_strdup(entry->d_name);
+        g_hash_table_insert(dir->names, name, name);
+    }
+    closedir(d);
+
+    dir->mtime = st.st_mtim;
+    return 0;
+}
+
+/* Whether dir is still the directory at path, the user may have removed or
+   renamed it since we opened it */
+static int vdagent_file_xfer_dir_is_current(AgentFileXferDir *dir,
+    const char *path)
+{
+    struct stat st, path_st;
+
+    if (fstat(dir->fd, &st) == -1 || st.st_nlink == 0)
+        return 0;
+    if (stat(path, &path_st) == -1)
+        return 0;
+    return st.st_dev == path_st.st_dev && st.st_ino == path_st.st_ino;
+}
+
+static AgentFileXferDir *vdagent_file_xfers_get_dir(
+    struct vdagent_file_xfers *xfers, const char *path)
+{
+    AgentFileXferDir *dir;
+
+    dir = g_hash_table_lookup(xfers->dirs, path);
+    if (dir && !vdagent_file_xfer_dir_is_current(dir, path)) {
+        if (xfers->debug)
+            syslog(LOG_DEBUG, "file-xfer: dir %s has changed, reopening",
+                   path);
+        g_hash_table_remove(xfers->dirs, path);
+        dir = NULL;
+    }
+    if (dir == NULL) {
+        if (g_mkdir_with_parents(path, S_IRWXU) == -1) {
+            syslog(LOG_ERR, "file-xfer: Failed to create dir %s", path);
+            return NULL;
+        }
+        dir = g_new0(AgentFileXferDir, 1);
+        dir->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir->fd == -1) {
+            syslog(LOG_ERR, "file-xfer: Failed to open dir %s: %s",
+                   path, strerror(errno));
+            g_free(dir);
+            return NULL;
+        }
+        if (g_hash_table_size(xfers->dirs) >= FILE_XFER_MAX_DIRS)
+            g_hash_table_remove_all(xfers->dirs);
+        g_hash_table_insert(xfers->dirs, g_strdup(path), dir);
+    }
+
+    if (vdagent_file_xfer_dir_scan(dir) == -1) {
+        syslog(LOG_ERR, "file-xfer: Failed to read dir %s: %s",
+               path, strerror(errno));
+        g_hash_table_remove(xfers->dirs, path);
+        return NULL;
+    }
+    return dir;
+}
+
+/* Create a new file named basename, or "basename (n)" if that is taken,
+   in dir. Returns the fd and sets *name_ret to the name used */
+static int vdagent_file_xfer_dir_create(AgentFileXferDir *dir,
+    const char *basename, char **name_ret)
+{
+    struct stat st;
+    char *name;
+    int i, fd;
+
+    name = g_strdup(basename);
+    for (i = 0; i < 64; i++) {
+        if (i) {
+            g_free(name);
+            name = g_strdup_printf("%s (%d)", basename, i);
+        }
+        if (g_hash_table_lookup(dir->names, name))
+            continue;
+
+        fd = openat(dir->fd, name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+                    0644);
+        if (fd == -1 && errno != EEXIST)
+            break;
+        g_hash_table_insert(dir->names, name, name);
+        if (fd != -1) {
+            /* Our own changes don't invalidate the cached names */
+            if (fstat(dir->fd, &st) == 0)
+                dir->mtime = st.st_mtim;
+            *name_ret = g_strdup(name);
+            return fd;
+        }
+        name = g_strdup(name);
+    }
+
+    if (i == 64) {
+        syslog(LOG_ERR, "file-xfer: more then 63 copies of %s exist?",
+               basename);
+        errno = EEXIST;
+    }
+    g_free(name);
+    return -1;
+}
+
 void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
     VDAgentFileXferStartMessage *msg)
 {
     AgentFileXferTask *task;
-    char *dir = NULL, *path = NULL, *file_path = NULL;
-    struct stat st;
-    int i;
+    AgentFileXferDir *dir;
+    char *dir_path = NULL, *basename = NULL, *name = NULL, *file_path = NULL;
+    char *path;
 
     g_return_if_fail(xfers != NULL);
 
@@ -193,31 +588,32 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
 
     file_path = g_build_filename(xfers->save_dir, task->file_name, NULL);
 
-    dir = g_path_get_dirname(file_path);
-    if (g_mkdir_with_parents(dir, S_IRWXU) == -1) {
-        syslog(LOG_ERR, "file-xfer: Failed to create dir %s", dir);
+    dir_path = g_path_get_dirname(file_path);
+    basename = g_path_get_basename(file_path);
+    dir = vdagent_file_xfers_get_dir(xfers, dir_path);
+    if (dir == NULL) {
         goto error;
     }
 
-    path = g_strdup(file_path);
-    for (i = 0; i < 64 && (stat(path, &st) == 0 || errno != ENOENT); i++) {
-        g_free(path);
-        path = g_strdup_printf("%s (%d)", file_path, i + 1);
-    }
-    g_free(task->file_name);
-    task->file_name = path;
-    if (i == 64) {
-        syslog(LOG_ERR, "file-xfer: more then 63 copies of %s exist?",
-               file_path);
-        goto error;
+    task->file_fd = vdagent_file_xfer_dir_create(dir, basename, &name);
+    if (task->file_fd == -1 && errno == ENOENT) {
+        /* The dir went away between the check and the create, make it
+           again and retry once */
+        g_hash_table_remove(xfers->dirs, dir_path);
+        dir = vdagent_file_xfers_get_dir(xfers, dir_path);
+        if (dir == NULL) {
+            goto error;
+        }
+        task->file_fd = vdagent_file_xfer_dir_create(dir, basename, &name);
     }
-
-    task->file_fd = open(path, O_CREAT | O_WRONLY, 0644);
     if (task->file_fd == -1) {
         syslog(LOG_ERR, "file-xfer: failed to create file %s: %s",
-               path, strerror(errno));
+               file_path, strerror(errno));
         goto error;
     }
+    path = g_build_filename(dir_path, name, NULL);
+    g_free(task->file_name);
+    task->file_name = path;
 
     if (ftruncate(task->file_fd, task->file_size) < 0) {
         syslog(LOG_ERR, "file-xfer: err reserving %"PRIu64" bytes for %s: %s",
@@ -231,21 +627,28 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
         syslog(LOG_DEBUG, "file-xfer: Adding task %u %s %"PRIu64" bytes",
                task->id, path, task->file_size);
 
-    udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
-                msg->id, VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA, NULL, 0);
+    vdagent_file_xfers_queue_status(xfers, msg->id,
+                                    VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA);
     g_free(file_path);
-    g_free(dir);
+    g_free(dir_path);
+    g_free(basename);
+    g_free(name);
     return ;
 
 error:
-    udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
-                msg->id, VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
+    vdagent_file_xfers_queue_status(xfers, msg->id,
+                                    VD_AGENT_FILE_XFER_STATUS_ERROR);
     if (task)
         vdagent_file_xfer_task_free(task);
     g_free(file_path);
-    g_free(dir);
+    g_free(dir_path);
+    g_free(basename);
+    g_free(name);
 }
 
+static void vdagent_file_xfers_send_status(struct vdagent_file_xfers *xfers,
+    VDAgentFileXferStatusMessage *msg);
+
 void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
     VDAgentFileXferStatusMessage *msg)
 {
@@ -253,6 +656,11 @@ void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
 
     g_return_if_fail(xfers != NULL);
 
+    if (msg->id & VDAGENTD_FILE_XFER_GUEST_ID) {
+        vdagent_file_xfers_send_status(xfers, msg);
+        return;
+    }
+
     task = vdagent_file_xfers_get_task(xfers, msg->id);
     if (!task)
         return;
@@ -268,6 +676,23 @@ void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
     }
 }
 
+static int vdagent_file_xfer_task_verify(AgentFileXferTask *task)
+{
+    const gchar *checksum;
+
+    if (!task->checksum)
+        return 1;
+
+    checksum = g_checksum_get_string(task->checksum);
+    if (g_ascii_strcasecmp(checksum, task->expected_checksum) != 0) {
+        syslog(LOG_ERR, "file-xfer: task %u %s checksum mismatch, "
+               "expected %s got %s", task->id, task->file_name,
+               task->expected_checksum, checksum);
+        return 0;
+    }
+    return 1;
+}
+
 void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     VDAgentFileXferDataMessage *msg)
 {
@@ -283,8 +708,16 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     len = write(task->file_fd, msg->data, msg->size);
     if (len == msg->size) {
         task->read_bytes += msg->size;
-        if (task->read_bytes >= task->file_size) {
-            if (task->read_bytes == task->file_size) {
+        if (task->checksum)
+            g_checksum_update(task->checksum, msg->data, msg->size);
+        if (task->read_bytes > task->file_size) {
+            syslog(LOG_ERR, "file-xfer: error received too much data");
+            status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+        } else if (task->read_bytes == task->file_size) {
+            if (!vdagent_file_xfer_task_verify(task)) {
+                /* Leave file_fd open so that the task free unlinks the file */
+                status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+            } else {
                 if (xfers->debug)
                     syslog(LOG_DEBUG, "file-xfer: task %u %s has completed",
                            task->id, task->file_name);
@@ -292,15 +725,9 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
                 task->file_fd = -1;
                 if (xfers->open_save_dir &&
                         task->file_xfer_nr == task->file_xfer_total &&
-                        g_hash_table_size(xfers->xfers) == 1) {
-                    char buf[PATH_MAX];
-                    snprintf(buf, PATH_MAX, "xdg-open '%s'&", xfers->save_dir);
-                    status = system(buf);
-                }
+                        g_hash_table_size(xfers->xfers) == 1)
+                    xfers->open_save_dir_pending = 1;
                 status = VD_AGENT_FILE_XFER_STATUS_SUCCESS;
-            } else {
-                syslog(LOG_ERR, "file-xfer: error received too much data");
-                status = VD_AGENT_FILE_XFER_STATUS_ERROR;
             }
         }
     } else {
@@ -310,16 +737,281 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     }
 
     if (status != -1) {
-        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
-                    msg->id, status, NULL, 0);
+        vdagent_file_xfers_queue_status(xfers, msg->id, status);
         g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(msg->id));
     }
 }
 
-void vdagent_file_xfers_error(struct udscs_connection *vdagentd, uint32_t msg_id)
+static void vdagent_file_xfers_open_save_dir(struct vdagent_file_xfers *xfers)
+{
+    char *argv[] = { "xdg-open", xfers->save_dir, NULL };
+    extern char **environ;
+    pid_t pid;
+    int r;
+
+    r = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+    if (r != 0)
+        syslog(LOG_ERR, "file-xfer: failed to run xdg-open: %s", strerror(r));
+    else
+        g_array_append_val(xfers->children, pid);
+}
+
+static void vdagent_file_xfers_check_timeout(struct vdagent_file_xfers *xfers);
+
+void vdagent_file_xfers_flush(struct vdagent_file_xfers *xfers)
 {
+    GArray *pending;
+    VDAgentFileXferStatusMessage *status;
+
+    g_return_if_fail(xfers != NULL);
+
+    vdagent_file_xfers_check_timeout(xfers);
+
+    pending = xfers->pending_status;
+    if (pending->len == 1) {
+        status = &g_array_index(pending, VDAgentFileXferStatusMessage, 0);
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
+                    status->id, status->result, NULL, 0);
+    } else if (pending->len > 1) {
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS, 0, 0,
+                    (uint8_t *)pending->data,
+                    pending->len * sizeof(VDAgentFileXferStatusMessage));
+    }
+    g_array_set_size(pending, 0);
+
+    if (xfers->open_save_dir_pending) {
+        vdagent_file_xfers_open_save_dir(xfers);
+        xfers->open_save_dir_pending = 0;
+    }
+
+    vdagent_file_xfers_reap_children(xfers);
+}
+
+void vdagent_file_xfers_error(struct vdagent_file_xfers *xfers,
+    struct udscs_connection *vdagentd, uint32_t msg_id)
+{
+    /* Keep the order of the statuses, if there is a queue, use it */
+    if (xfers) {
+        vdagent_file_xfers_queue_status(xfers, msg_id,
+                                        VD_AGENT_FILE_XFER_STATUS_ERROR);
+        return;
+    }
+
     g_return_if_fail(vdagentd != NULL);
 
     udscs_write(vdagentd, VDAGENTD_FILE_XFER_STATUS,
                 msg_id, VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
 }
+
+/* Guest -> client xfers */
+
+static void vdagent_file_xfers_send_next(struct vdagent_file_xfers *xfers);
+
+static void vdagent_file_xfers_send_done(struct vdagent_file_xfers *xfers)
+{
+    vdagent_file_xfer_send_task_free(xfers->send_task);
+    xfers->send_task = NULL;
+    vdagent_file_xfers_send_next(xfers);
+}
+
+static void vdagent_file_xfers_send_data(struct vdagent_file_xfers *xfers)
+{
+    AgentFileXferSendTask *task = xfers->send_task;
+    VDAgentFileXferDataMessage *msg;
+    ssize_t len;
+
+    if (!task || !task->can_send)
+        return;
+
+    if (!xfers->send_buf)
+        xfers->send_buf = g_malloc(sizeof(*msg) + FILE_XFER_SEND_CHUNK_SIZE);
+    msg = (VDAgentFileXferDataMessage *)xfers->send_buf;
+
+    while (xfers->send_in_flight < FILE_XFER_SEND_WINDOW &&
+           task->sent_bytes < task->file_size) {
+        len = read(task->file_fd, msg->data, FILE_XFER_SEND_CHUNK_SIZE);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            if (len < 0)
+                syslog(LOG_ERR, "file-xfer: error reading %s: %s",
+                       task->file_name, strerror(errno));
+            else
+                syslog(LOG_ERR, "file-xfer: %s was truncated while sending",
+                       task->file_name);
+            vdagent_file_xfers_queue_status(xfers, task->id,
+                                            VD_AGENT_FILE_XFER_STATUS_ERROR);
+            vdagent_file_xfers_send_done(xfers);
+            return;
+        }
+        if (len > task->file_size - task->sent_bytes)
+            len = task->file_size - task->sent_bytes;
+
+        msg->id = task->id;
+        msg->size = len;
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_DATA, 0, 0,
+                    xfers->send_buf, sizeof(*msg) + len);
+        task->sent_bytes += len;
+        xfers->send_in_flight++;
+    }
+
+    if (task->sent_bytes == task->file_size) {
+        /* The client reports success or failure with a status message,
+           which we don't need to wait for */
+        if (xfers->debug)
+            syslog(LOG_DEBUG, "file-xfer: task %u %s has been sent",
+                   task->id, task->file_name);
+        vdagent_file_xfers_send_done(xfers);
+    }
+}
+
+static void vdagent_file_xfers_send_next(struct vdagent_file_xfers *xfers)
+{
+    AgentFileXferSendTask *task;
+    VDAgentFileXferStartMessage *msg;
+    GKeyFile *keyfile;
+    gchar *basename, *data;
+    gsize data_size;
+    struct stat st;
+    char *path;
+
+    while (!xfers->send_task &&
+           (path = g_queue_pop_head(xfers->send_queue)) != NULL) {
+        task = g_new0(AgentFileXferSendTask, 1);
+        task->file_name = path;
+        task->file_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (task->file_fd == -1) {
+            syslog(LOG_ERR, "file-xfer: failed to open %s: %s",
+                   path, strerror(errno));
+            vdagent_file_xfer_send_task_free(task);
+            continue;
+        }
+        if (fstat(task->file_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            syslog(LOG_ERR, "file-xfer: %s is not a regular file", path);
+            vdagent_file_xfer_send_task_free(task);
+            continue;
+        }
+        /* Let the kernel read ahead, we go through the file exactly once */
+        posix_fadvise(task->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        task->file_size = st.st_size;
+        task->id = VDAGENTD_FILE_XFER_GUEST_ID | xfers->send_id++;
+
+        keyfile = g_key_file_new();
+        basename = g_path_get_basename(path);
+        g_key_file_set_string(keyfile, "vdagent-file-xfer", "name", basename);
+        g_key_file_set_uint64(keyfile, "vdagent-file-xfer", "size",
+                              task->file_size);
+        data = g_key_file_to_data(keyfile, &data_size, NULL);
+        g_key_file_free(keyfile);
+        g_free(basename);
+
+        msg = g_malloc(sizeof(*msg) + data_size + 1);
+        msg->id = task->id;
+        memcpy(msg->data, data, data_size + 1);
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_START, 0, 0,
+                    (uint8_t *)msg, sizeof(*msg) + data_size + 1);
+        g_free(msg);
+        g_free(data);
+
+        if (xfers->debug)
+            syslog(LOG_DEBUG, "file-xfer: Sending task %u %s %"PRIu64" bytes",
+                   task->id, path, task->file_size);
+        task->start_timeout = g_get_monotonic_time() +
+                              FILE_XFER_SEND_START_TIMEOUT;
+        xfers->send_task = task;
+    }
+}
+
+static void vdagent_file_xfers_send_status(struct vdagent_file_xfers *xfers,
+    VDAgentFileXferStatusMessage *msg)
+{
+    AgentFileXferSendTask *task = xfers->send_task;
+
+    if (!task || task->id != msg->id) {
+        /* Completion status for a file we've already finished sending */
+        if (xfers->debug)
+            syslog(LOG_DEBUG, "file-xfer: status %u for sent task %u",
+                   msg->result, msg->id);
+        return;
+    }
+
+    if (msg->result == VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA) {
+        task->can_send = 1;
+        task->start_timeout = 0;
+        vdagent_file_xfers_send_data(xfers);
+    } else {
+        syslog(LOG_ERR, "file-xfer: client refused or cancelled task %u %s",
+               task->id, task->file_name);
+        vdagent_file_xfers_send_done(xfers);
+    }
+}
+
+void vdagent_file_xfers_data_ack(struct vdagent_file_xfers *xfers,
+    uint32_t count)
+{
+    g_return_if_fail(xfers != NULL);
+
+    if (count > xfers->send_in_flight)
+        count = xfers->send_in_flight;
+    xfers->send_in_flight -= count;
+    vdagent_file_xfers_send_data(xfers);
+}
+
+gint64 vdagent_file_xfers_get_timeout(struct vdagent_file_xfers *xfers)
+{
+    g_return_val_if_fail(xfers != NULL, 0);
+
+    return xfers->send_task ? xfers->send_task->start_timeout : 0;
+}
+
+/* Give up on a file the client did not accept in time, it may not even
+   have understood the start, and go on with the next one */
+static void vdagent_file_xfers_check_timeout(struct vdagent_file_xfers *xfers)
+{
+    AgentFileXferSendTask *task = xfers->send_task;
+
+    if (!task || !task->start_timeout ||
+            g_get_monotonic_time() < task->start_timeout)
+        return;
+
+    syslog(LOG_ERR, "file-xfer: client did not accept task %u %s in time",
+           task->id, task->file_name);
+    vdagent_file_xfers_queue_status(xfers, task->id,
+                                    VD_AGENT_FILE_XFER_STATUS_ERROR);
+    vdagent_file_xfers_send_done(xfers);
+}
+
+int vdagent_file_xfers_get_fd(struct vdagent_file_xfers *xfers)
+{
+    g_return_val_if_fail(xfers != NULL, -1);
+
+    return xfers->inotify_fd;
+}
+
+void vdagent_file_xfers_handle_fd(struct vdagent_file_xfers *xfers)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *p;
+
+    g_return_if_fail(xfers != NULL);
+
+    while ((len = read(xfers->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len;
+             p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if (event->len == 0 || (event->mask & IN_ISDIR))
+                continue;
+            g_queue_push_tail(xfers->send_queue,
+                              g_build_filename(xfers->send_dir, event->name,
+                                               NULL));
+        }
+    }
+    if (len == -1 && errno != EAGAIN && errno != EINTR)
+        syslog(LOG_ERR, "file-xfer: error reading inotify events: %s",
+               strerror(errno));
+
+    vdagent_file_xfers_send_next(xfers);
+}
@@ -22,14 +22,17 @@
 #ifndef __VDAGENT_FILE_XFERS_H
 #define __VDAGENT_FILE_XFERS_H
 
+#include <glib.h>
 #include "udscs.h"
 
 struct vdagent_file_xfers;
 
 struct vdagent_file_xfers *vdagent_file_xfers_create(
         struct udscs_connection *vdagentd, const char *save_dir,
-        int open_save_dir, int debug);
-void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfer);
+        int open_save_dir, const char *send_dir, int debug);
+/* Sends any still queued statuses, unless vdagentd_disconnected */
+void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfer,
+        int vdagentd_disconnected);
 
 void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
     VDAgentFileXferStartMessage *msg);
@@ -37,7 +40,22 @@ void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
     VDAgentFileXferStatusMessage *msg);
 void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     VDAgentFileXferDataMessage *msg);
-void vdagent_file_xfers_error(struct udscs_connection *vdagentd,
-    uint32_t msg_id);
+/* Send an error status for msg_id, queued with the other statuses if there
+   is an xfers, directly through vdagentd otherwise */
+void vdagent_file_xfers_error(struct vdagent_file_xfers *xfers,
+    struct udscs_connection *vdagentd, uint32_t msg_id);
+/* Send the status messages queued while handling messages and fds, to be
+   called once per main loop iteration */
+void vdagent_file_xfers_flush(struct vdagent_file_xfers *xfers);
+
+/* Guest -> client xfers of files written to the send_dir passed to create */
+void vdagent_file_xfers_data_ack(struct vdagent_file_xfers *xfers,
+    uint32_t count);
+/* Returns when the file being sent times out waiting for the client, as
+   g_get_monotonic_time, or 0; vdagent_file_xfers_flush handles it */
+gint64 vdagent_file_xfers_get_timeout(struct vdagent_file_xfers *xfers);
+/* Returns the fd to watch for send_dir changes, or -1 */
+int vdagent_file_xfers_get_fd(struct vdagent_file_xfers *xfers);
+void vdagent_file_xfers_handle_fd(struct vdagent_file_xfers *xfers);
 
 #endif
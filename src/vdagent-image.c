@@ -0,0 +1,153 @@
+/*  vdagent-image.c vdagent clipboard image conversion
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <spice/vd_agent.h>
+#include "vdagent-image.h"
+
+#ifdef HAVE_GDK_PIXBUF
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+/* The gdk-pixbuf format name for a clipboard type */
+static const char *vdagent_image_format_name(uint32_t type)
+{
+    switch (type) {
+    case VD_AGENT_CLIPBOARD_IMAGE_PNG:
+        return "png";
+    case VD_AGENT_CLIPBOARD_IMAGE_BMP:
+        return "bmp";
+    case VD_AGENT_CLIPBOARD_IMAGE_TIFF:
+        return "tiff";
+    case VD_AGENT_CLIPBOARD_IMAGE_JPG:
+        return "jpeg";
+    default:
+        return NULL;
+    }
+}
+
+static GdkPixbufFormat *vdagent_image_find_format(const char *name)
+{
+    GSList *formats, *l;
+    GdkPixbufFormat *format = NULL;
+    gchar *format_name;
+
+    formats = gdk_pixbuf_get_formats();
+    for (l = formats; l && !format; l = l->next) {
+        format_name = gdk_pixbuf_format_get_name(l->data);
+        if (strcmp(format_name, name) == 0)
+            format = l->data;
+        g_free(format_name);
+    }
+    g_slist_free(formats);
+
+    return format;
+}
+
+int vdagent_image_can_convert(uint32_t from, uint32_t to)
+{
+    const char *from_name = vdagent_image_format_name(from);
+    const char *to_name = vdagent_image_format_name(to);
+    GdkPixbufFormat *format;
+
+    /* Never convert to jpeg, it is lossy and drops the alpha channel */
+    if (!from_name || !to_name || from == to ||
+            to == VD_AGENT_CLIPBOARD_IMAGE_JPG)
+        return 0;
+
+    format = vdagent_image_find_format(to_name);
+    if (!format || !gdk_pixbuf_format_is_writable(format))
+        return 0;
+
+    return vdagent_image_find_format(from_name) != NULL;
+}
+
+int vdagent_image_convert(uint32_t from, const uint8_t *data, uint32_t size,
+                          uint32_t to, uint8_t **data_ret, uint32_t *size_ret)
+{
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf;
+    GError *error = NULL;
+    gchar *buf = NULL;
+    gsize buf_size;
+    int ret = -1;
+
+    *data_ret = NULL;
+    *size_ret = 0;
+
+    loader = gdk_pixbuf_loader_new_with_type(vdagent_image_format_name(from),
+                                             &error);
+    if (!loader)
+        goto exit;
+
+    if (!gdk_pixbuf_loader_write(loader, data, size, &error) ||
+            !gdk_pixbuf_loader_close(loader, &error))
+        goto exit;
+
+    pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    if (!pixbuf ||
+            !gdk_pixbuf_save_to_buffer(pixbuf, &buf, &buf_size,
+                                       vdagent_image_format_name(to),
+                                       &error, NULL))
+        goto exit;
+
+    /* Our callers free the data with free() */
+    *data_ret = malloc(buf_size);
+    if (!*data_ret) {
+        syslog(LOG_ERR, "out of memory converting clipboard image");
+        goto exit;
+    }
+    memcpy(*data_ret, buf, buf_size);
+    *size_ret = buf_size;
+    ret = 0;
+
+exit:
+    if (error) {
+        syslog(LOG_ERR, "converting clipboard image from %s to %s: %s",
+               vdagent_image_format_name(from), vdagent_image_format_name(to),
+               error->message);
+        g_error_free(error);
+    }
+    if (loader) {
+        /* Closing an already closed loader is a no-op */
+        gdk_pixbuf_loader_close(loader, NULL);
+        g_object_unref(loader);
+    }
+    g_free(buf);
+    return ret;
+}
+
+#else
+
+int vdagent_image_can_convert(uint32_t from, uint32_t to)
+{
+    return 0;
+}
+
+int vdagent_image_convert(uint32_t from, const uint8_t *data, uint32_t size,
+                          uint32_t to, uint8_t **data_ret, uint32_t *size_ret)
+{
+    *data_ret = NULL;
+    *size_ret = 0;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*  vdagent-image.h vdagent clipboard image conversion header
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_IMAGE_H
+#define __VDAGENT_IMAGE_H
+
+#include <stdint.h>
+
+/* Returns 1 if clipboard data of type from can be converted to type to,
+   both being VD_AGENT_CLIPBOARD_IMAGE_* types. Always returns 0 when built
+   without image conversion support. */
+int vdagent_image_can_convert(uint32_t from, uint32_t to);
+
+/* Convert clipboard image data of type from to type to. On success returns
+   0 and stores the malloc-ed result in data_ret and size_ret, on failure
+   returns -1. */
+int vdagent_image_convert(uint32_t from, const uint8_t *data, uint32_t size,
+                          uint32_t to, uint8_t **data_ret, uint32_t *size_ret);
+
+#endif
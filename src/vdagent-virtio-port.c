@@ -31,6 +31,10 @@
 
 #include "vdagent-virtio-port.h"
 
+/* We read as much as is available at once, rather than a single chunk
+   header or chunk at a time, so that a burst of small messages (such as
+   mouse events) gets handled with one read */
+#define VDP_READ_BUF_SIZE (64 * 1024)
 
 struct vdagent_virtio_port_buf {
     uint8_t *buf;
@@ -60,6 +64,7 @@ struct vdagent_virtio_port {
     int chunk_data_pos;
     VDIChunkHeader chunk_header;
     uint8_t chunk_data[VD_AGENT_MAX_DATA_SIZE];
+    uint8_t read_buf[VDP_READ_BUF_SIZE];
 
     /* Per chunk port data */
     struct vdagent_virtio_port_chunk_port_data port_data[VDP_END_PORT];
@@ -67,9 +72,11 @@ struct vdagent_virtio_port {
     /* Writes are stored in a linked list of buffers, with both the header
        + data for a single message in 1 buffer. */
     struct vdagent_virtio_port_buf *write_buf, *last_buf;
+    size_t write_queue_size;
 
     /* Callbacks */
     vdagent_virtio_port_read_callback read_callback;
+    vdagent_virtio_port_partial_read_callback partial_read_callback;
     vdagent_virtio_port_disconnect_callback disconnect_callback;
 };
 
@@ -150,6 +157,13 @@ void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp)
     *vportp = NULL;
 }
 
+void vdagent_virtio_port_set_partial_read_callback(
+    struct vdagent_virtio_port *vport,
+    vdagent_virtio_port_partial_read_callback partial_read_callback)
+{
+    vport->partial_read_callback = partial_read_callback;
+}
+
 int vdagent_virtio_port_fill_fds(struct vdagent_virtio_port *vport,
         fd_set *readfds, fd_set *writefds)
 {
@@ -221,6 +235,7 @@ int vdagent_virtio_port_write_start(
         vport->last_buf->next = new_wbuf;
     }
     vport->last_buf = new_wbuf;
+    vport->write_queue_size += new_wbuf->size;
 
     return 0;
 }
@@ -246,6 +261,50 @@ int vdagent_virtio_port_write_append(struct vdagent_virtio_port *vport,
     return 0;
 }
 
+int vdagent_virtio_port_write_buf(
+        struct vdagent_virtio_port *vport,
+        uint32_t port_nr,
+        uint32_t message_type,
+        uint32_t message_opaque,
+        uint8_t *buf,
+        uint32_t data_size)
+{
+    struct vdagent_virtio_port_buf *new_wbuf;
+    VDIChunkHeader chunk_header;
+    VDAgentMessage message_header;
+
+    new_wbuf = malloc(sizeof(*new_wbuf));
+    if (!new_wbuf)
+        return -1;
+
+    chunk_header.port = port_nr;
+    chunk_header.size = sizeof(message_header) + data_size;
+    memcpy(buf, &chunk_header, sizeof(chunk_header));
+
+    message_header.protocol = VD_AGENT_PROTOCOL;
+    message_header.type = message_type;
+    message_header.opaque = message_opaque;
+    message_header.size = data_size;
+    memcpy(buf + sizeof(chunk_header), &message_header,
+           sizeof(message_header));
+
+    new_wbuf->buf = buf;
+    new_wbuf->pos = 0;
+    new_wbuf->size = VDAGENT_VIRTIO_PORT_HEADER_SIZE + data_size;
+    new_wbuf->write_pos = new_wbuf->size;
+    new_wbuf->next = NULL;
+
+    if (!vport->write_buf) {
+        vport->write_buf = new_wbuf;
+    } else {
+        vport->last_buf->next = new_wbuf;
+    }
+    vport->last_buf = new_wbuf;
+    vport->write_queue_size += new_wbuf->size;
+
+    return 0;
+}
+
 int vdagent_virtio_port_write(
         struct vdagent_virtio_port *vport,
         uint32_t port_nr,
@@ -262,6 +321,12 @@ int vdagent_virtio_port_write(
     return 0;
 }
 
+size_t vdagent_virtio_port_get_write_queue_size(
+        struct vdagent_virtio_port *vport)
+{
+    return vport->write_queue_size;
+}
+
 void vdagent_virtio_port_flush(struct vdagent_virtio_port **vportp)
 {
     while (*vportp && (*vportp)->write_buf)
@@ -324,6 +389,14 @@ static void vdagent_virtio_port_do_chunk(struct vdagent_virtio_port **vportp)
             port->message_data_pos += read;
         }
 
+        if (read && port->message_data_pos < port->message_header.size &&
+                vport->partial_read_callback) {
+            vport->partial_read_callback(vport, vport->chunk_header.port,
+                                         &port->message_header,
+                                         port->message_data,
+                                         port->message_data_pos);
+        }
+
         if (port->message_data_pos == port->message_header.size) {
             if (vport->read_callback) {
                 int r = vport->read_callback(vport, vport->chunk_header.port,
@@ -352,20 +425,11 @@ static int vport_read(struct vdagent_virtio_port *vport, uint8_t *buf, int len)
 
 static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
 {
-    ssize_t n;
-    size_t to_read;
-    uint8_t *dest;
+    ssize_t n, pos;
+    size_t len;
     struct vdagent_virtio_port *vport = *vportp;
 
-    if (vport->chunk_header_read < sizeof(vport->chunk_header)) {
-        to_read = sizeof(vport->chunk_header) - vport->chunk_header_read;
-        dest = (uint8_t *)&vport->chunk_header + vport->chunk_header_read;
-    } else {
-        to_read = vport->chunk_header.size - vport->chunk_data_pos;
-        dest = vport->chunk_data + vport->chunk_data_pos;
-    }
-
-    n = vport_read(vport, dest, to_read);
+    n = vport_read(vport, vport->read_buf, sizeof(vport->read_buf));
     if (n < 0) {
         if (errno == EINTR)
             return;
@@ -401,9 +465,18 @@ static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
     }
     vport->opening = 0;
 
-    if (vport->chunk_header_read < sizeof(vport->chunk_header)) {
-        vport->chunk_header_read += n;
-        if (vport->chunk_header_read == sizeof(vport->chunk_header)) {
+    pos = 0;
+    while (pos < n) {
+        if (vport->chunk_header_read < sizeof(vport->chunk_header)) {
+            len = sizeof(vport->chunk_header) - vport->chunk_header_read;
+            if (len > n - pos)
+                len = n - pos;
+            memcpy((uint8_t *)&vport->chunk_header + vport->chunk_header_read,
+                   vport->read_buf + pos, len);
+            vport->chunk_header_read += len;
+            pos += len;
+            if (vport->chunk_header_read < sizeof(vport->chunk_header))
+                break;
             if (vport->chunk_header.size > VD_AGENT_MAX_DATA_SIZE) {
                 syslog(LOG_ERR, "chunk size %u too large",
                        vport->chunk_header.size);
@@ -416,9 +489,16 @@ static void vdagent_virtio_port_do_read(struct vdagent_virtio_port **vportp)
                 vdagent_virtio_port_destroy(vportp);
                 return;
             }
+        } else {
+            len = vport->chunk_header.size - vport->chunk_data_pos;
+            if (len > n - pos)
+                len = n - pos;
+            memcpy(vport->chunk_data + vport->chunk_data_pos,
+                   vport->read_buf + pos, len);
+            vport->chunk_data_pos += len;
+            pos += len;
         }
-    } else {
-        vport->chunk_data_pos += n;
+
         if (vport->chunk_data_pos == vport->chunk_header.size) {
             vdagent_virtio_port_do_chunk(vportp);
             if (!*vportp)
@@ -468,6 +548,7 @@ static void vdagent_virtio_port_do_write(struct vdagent_virtio_port **vportp)
         vport->opening = 0;
 
     wbuf->pos += n;
+    vport->write_queue_size -= n;
     if (wbuf->pos == wbuf->size) {
         vport->write_buf = wbuf->next;
         if (!vport->write_buf) vport->last_buf = NULL;
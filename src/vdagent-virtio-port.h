@@ -40,6 +40,17 @@ typedef int (*vdagent_virtio_port_read_callback)(
     VDAgentMessage *message_header,
     uint8_t *data);
 
+/* Callbacks with this type will be called each time more data has been
+   received for a message which spans multiple chunks, before the message is
+   complete. data holds the first data_pos bytes of the message data. The
+   read callback still gets called for the complete message. */
+typedef void (*vdagent_virtio_port_partial_read_callback)(
+    struct vdagent_virtio_port *vport,
+    int port_nr,
+    VDAgentMessage *message_header,
+    uint8_t *data,
+    uint32_t data_pos);
+
 /* Callbacks with this type will be called when the port is disconnected.
    Note:
    1) vdagent_virtio_port will destroy the port in question itself after
@@ -59,6 +70,11 @@ struct vdagent_virtio_port *vdagent_virtio_port_create(const char *portname,
 /* The contents of portp will be made NULL */
 void vdagent_virtio_port_destroy(struct vdagent_virtio_port **vportp);
 
+/* Optionally get notified of partially received messages */
+void vdagent_virtio_port_set_partial_read_callback(
+    struct vdagent_virtio_port *vport,
+    vdagent_virtio_port_partial_read_callback partial_read_callback);
+
 
 /* Given a vdagent_virtio_port fill the fd_sets pointed to by readfds and
    writefds for select() usage.
@@ -98,6 +114,29 @@ int vdagent_virtio_port_write(
         const uint8_t *data,
         uint32_t data_size);
 
+/* Bytes of headroom buffers passed to vdagent_virtio_port_write_buf must
+   have before the message data */
+#define VDAGENT_VIRTIO_PORT_HEADER_SIZE \
+    (sizeof(VDIChunkHeader) + sizeof(VDAgentMessage))
+
+/* Queue a message for delivery without copying it. buf must be malloc-ed,
+   start with VDAGENT_VIRTIO_PORT_HEADER_SIZE bytes of room for the headers
+   and be followed by data_size bytes of message data. On success the port
+   takes ownership of buf, on failure the caller still owns it.
+
+   Returns 0 on success -1 on error (only happens when malloc fails) */
+int vdagent_virtio_port_write_buf(
+        struct vdagent_virtio_port *vport,
+        uint32_t port_nr,
+        uint32_t message_type,
+        uint32_t message_opaque,
+        uint8_t *buf,
+        uint32_t data_size);
+
+/* Returns the number of bytes queued for delivery but not yet written */
+size_t vdagent_virtio_port_get_write_queue_size(
+        struct vdagent_virtio_port *vport);
+
 void vdagent_virtio_port_flush(struct vdagent_virtio_port **vportp);
 void vdagent_virtio_port_reset(struct vdagent_virtio_port *vport, int port);
 
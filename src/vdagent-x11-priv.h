@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <glib.h>
 #include <spice/vd_agent.h>
 
 #include <X11/extensions/Xrandr.h>
@@ -29,24 +30,70 @@ enum { owner_none, owner_guest, owner_client };
 
 /* X11 terminology is confusing a selection request is a request from an
    app to get clipboard data from us, so iow from the spice client through
-   the vdagent channel. We handle these one at a time and queue any which
-   come in while we are still handling the current one. */
+   the vdagent channel. Requests which need data from the client are queued
+   until it arrives, all requests for the same selection and type share a
+   single request to the client. For types we offer by converting the data
+   from the client, source is the type we request from the client. */
 struct vdagent_x11_selection_request {
     XEvent event;
     uint8_t selection;
+    uint32_t type;
+    uint32_t source;
     struct vdagent_x11_selection_request *next;
 };
 
+/* State of an incr send of clipboard data to a requestor. Several of these
+   can be in progress at once, they are keyed by the (requestor, property)
+   pair the data is being written to, see INCR_SEND_KEY. */
+struct vdagent_x11_incr_send {
+    guint64 key;
+    Window requestor;
+    Atom property;
+    Atom target;
+    uint8_t selection;
+    struct vdagent_x11_clipboard_buffer *data;
+    uint32_t pos;
+    int waiting; /* sent all data we have, but the data is not complete */
+    int aborted; /* the rest of the data is not coming, end the send */
+};
+
+#define INCR_SEND_KEY(requestor, property) \
+    (((guint64)(requestor) << 32) | (guint32)(property))
+
 /* A conversion request is X11 speak for asking an other app to give its
    clipboard data to us, we do these on behalf of the spice client to copy
-   data from the guest to the client. Like selection requests we process
-   these one at a time. */
+   data from the guest to the client. Since all conversions use the same
+   property on our selection window, we process these one at a time. */
 struct vdagent_x11_conversion_request {
     Atom target;
     uint8_t selection;
+    uint32_t type; /* the type the client asked for, it gets converted to
+                      this if target is of another type */
     struct vdagent_x11_conversion_request *next;
 };
 
+/* Clipboard data received from the client. These get cached per selection
+   and type, so that repeated requests for the same data can be answered
+   without a round trip to the client. Since a cached buffer may also be
+   in the middle of being sent through incr, they are refcounted. Large data
+   may still be coming in while it is being sent, then complete is 0. */
+struct vdagent_x11_clipboard_buffer {
+    int ref;
+    int complete;
+    uint32_t type;
+    uint8_t *data;
+    uint32_t size;
+    uint32_t space;
+};
+
+/* Client clipboard data larger than this does not get cached */
+#define CLIPBOARD_CACHE_MAX_SIZE (32 * 1024 * 1024)
+
+/* Guest clipboard data received through incr gets passed on to vdagentd in
+   VDAGENTD_CLIPBOARD_DATA_CHUNK-s of about this size as it comes in, rather
+   than all at once when complete */
+#define CLIPBOARD_STREAM_CHUNK_SIZE (1024 * 1024)
+
 struct clipboard_format_tmpl {
     uint32_t type;
     const char *atom_names[16];
@@ -63,6 +110,23 @@ struct monitor_size {
     int height;
 };
 
+/* A mode we created for an output. These are kept around, so that going
+   back to a recent size does not need a new mode, and get destroyed in bulk
+   once an output has more than RANDR_MODE_CACHE_SIZE, least recently used
+   first. They are keyed by output and size, see RANDR_MODE_KEY. */
+struct vdagent_x11_randr_mode {
+    guint64 key;
+    RRMode id;
+    int output;
+    guint64 last_used;
+};
+
+#define RANDR_MODE_CACHE_SIZE 8
+
+#define RANDR_MODE_KEY(output, width, height) \
+    (((guint64)(output) << 48) | \
+     ((guint64)((width) & 0xffffff) << 24) | ((height) & 0xffffff))
+
 static const struct clipboard_format_tmpl clipboard_format_templates[] = {
     { VD_AGENT_CLIPBOARD_UTF8_TEXT, { "UTF8_STRING", "text/plain;charset=UTF-8",
       "text/plain;charset=utf-8", "STRING", NULL }, },
@@ -75,6 +139,31 @@ static const struct clipboard_format_tmpl clipboard_format_templates[] = {
 
 #define clipboard_format_count (sizeof(clipboard_format_templates)/sizeof(clipboard_format_templates[0]))
 
+/* The selections we handle: CLIPBOARD and PRIMARY */
+#define SELECTION_COUNT (VD_AGENT_CLIPBOARD_SELECTION_PRIMARY + 1)
+
+/* Per selection clipboard state. Whoever owns the selection, we only keep
+   the types we know, so there is at most one type per clipboard format.
+   Images are also offered in the formats we can convert them to, for these
+   source_types holds the type of the data we convert from. */
+struct vdagent_x11_selection {
+    int owner;
+    int expected_targets_notifies;
+    int type_count;
+    uint32_t agent_types[clipboard_format_count];
+    uint32_t source_types[clipboard_format_count];
+    Atom x11_targets[clipboard_format_count];
+    struct vdagent_x11_clipboard_buffer *cache[clipboard_format_count];
+};
+
+/* target_formats values hold the clipboard_formats index and the rank of
+   the atom within its atoms (lower is preferred), offset by 1 to not be
+   NULL */
+#define TARGET_FORMAT_VALUE(format, rank) \
+    GUINT_TO_POINTER((((format) << 8) | (rank)) + 1)
+#define TARGET_FORMAT(value) ((GPOINTER_TO_UINT(value) - 1) >> 8)
+#define TARGET_FORMAT_RANK(value) ((GPOINTER_TO_UINT(value) - 1) & 0xff)
+
 struct vdagent_x11 {
     struct clipboard_format_info clipboard_formats[clipboard_format_count];
     Display *display;
@@ -84,6 +173,11 @@ struct vdagent_x11 {
     Atom incr_atom;
     Atom multiple_atom;
     Atom timestamp_atom;
+    /* Atom names we have looked up, XGetAtomName is a server round trip.
+       Atoms are never freed by the server, so these never get stale. */
+    GHashTable *atom_names;
+    /* Index of clipboard_formats by target atom, see TARGET_FORMAT_* */
+    GHashTable *target_formats;
     Window root_window[MAX_SCREENS];
     Window selection_window;
     struct udscs_connection *vdagentd;
@@ -97,34 +191,44 @@ struct vdagent_x11 {
     int xfixes_event_base;
     int xrandr_event_base;
     int max_prop_size;
-    int expected_targets_notifies[256];
-    int clipboard_owner[256];
-    int clipboard_type_count[256];
-    uint32_t clipboard_agent_types[256][256];
-    Atom clipboard_x11_targets[256][256];
+    struct vdagent_x11_selection selections[SELECTION_COUNT];
     /* Data for conversion_req which is currently being processed */
     struct vdagent_x11_conversion_request *conversion_req;
+    struct vdagent_x11_conversion_request *conversion_req_tail;
     int expect_property_notify;
     uint8_t *clipboard_data;
     uint32_t clipboard_data_size;
     uint32_t clipboard_data_space;
-    /* Data for selection_req which is currently being processed */
+    uint32_t clipboard_data_retain;
+    /* Selection requests waiting for data from the client */
     struct vdagent_x11_selection_request *selection_req;
-    uint8_t *selection_req_data;
-    uint32_t selection_req_data_pos;
-    uint32_t selection_req_data_size;
-    Atom selection_req_atom;
-    /* resolution change state */
+    struct vdagent_x11_selection_request *selection_req_tail;
+    /* Incr sends in progress, struct vdagent_x11_incr_send by key */
+    GHashTable *incr_sends;
+    /* Client clipboard data which is still coming in */
+    struct vdagent_x11_clipboard_buffer *client_stream;
+    uint8_t client_stream_selection;
+    int client_stream_dropped; /* drop the rest of it, after an error */
+    /* resolution change state, the RandR resources are cached and only
+       the parts which have changed get fetched again, see refresh_randr_res
+       in vdagent-x11-randr.c */
     struct {
         XRRScreenResources *res;
         XRROutputInfo **outputs;
         XRRCrtcInfo **crtcs;
+        int res_dirty;
+        int *output_dirty;
+        int *crtc_dirty;
         int min_width;
         int max_width;
         int min_height;
         int max_height;
         int num_monitors;
         struct monitor_size monitor_sizes[MONITOR_SIZE_COUNT];
+        /* Modes we created, struct vdagent_x11_randr_mode by key */
+        GHashTable *modes;
+        int mode_count[MONITOR_SIZE_COUNT];
+        guint64 mode_use_count;
         VDAgentMonitorsConfig *failed_conf;
     } randr;
 
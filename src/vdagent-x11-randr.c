@@ -86,12 +86,28 @@ static void free_randr_resources(struct vdagent_x11 *x11)
         free(x11->randr.crtcs);
     }
     XRRFreeScreenResources(x11->randr.res);
+    free(x11->randr.output_dirty);
+    free(x11->randr.crtc_dirty);
     x11->randr.res = NULL;
     x11->randr.outputs = NULL;
     x11->randr.crtcs = NULL;
+    x11->randr.output_dirty = NULL;
+    x11->randr.crtc_dirty = NULL;
     x11->randr.num_monitors = 0;
 }
 
+static void count_monitors(struct vdagent_x11 *x11)
+{
+    int i;
+
+    x11->randr.num_monitors = 0;
+    for (i = 0 ; i < x11->randr.res->noutput; ++i) {
+        if (x11->randr.outputs[i]->connection == RR_Connected)
+            x11->randr.num_monitors++;
+    }
+}
+
+/* Fetch all RandR resources, with poll the server probes the outputs */
 static void update_randr_res(struct vdagent_x11 *x11, int poll)
 {
     int i;
@@ -101,19 +117,22 @@ static void update_randr_res(struct vdagent_x11 *x11, int poll)
         x11->randr.res = XRRGetScreenResources(x11->display, x11->root_window[0]);
     else
         x11->randr.res = XRRGetScreenResourcesCurrent(x11->display, x11->root_window[0]);
+    x11->randr.res_dirty = 0;
     x11->randr.outputs = malloc(x11->randr.res->noutput * sizeof(*x11->randr.outputs));
     x11->randr.crtcs = malloc(x11->randr.res->ncrtc * sizeof(*x11->randr.crtcs));
+    x11->randr.output_dirty = calloc(x11->randr.res->noutput, sizeof(int));
+    x11->randr.crtc_dirty = calloc(x11->randr.res->ncrtc, sizeof(int));
     for (i = 0 ; i < x11->randr.res->noutput; ++i) {
         x11->randr.outputs[i] = XRRGetOutputInfo(x11->display, x11->randr.res,
                                                  x11->randr.res->outputs[i]);
-        if (x11->randr.outputs[i]->connection == RR_Connected)
-            x11->randr.num_monitors++;
     }
+    count_monitors(x11);
     for (i = 0 ; i < x11->randr.res->ncrtc; ++i) {
         x11->randr.crtcs[i] = XRRGetCrtcInfo(x11->display, x11->randr.res,
                                              x11->randr.res->crtcs[i]);
     }
-    /* XXX is this dynamic? should it be cached? */
+    /* The size range only changes with the driver, so this is the only
+       place where it gets fetched */
     if (XRRGetScreenSizeRange(x11->display, x11->root_window[0],
                               &x11->randr.min_width,
                               &x11->randr.min_height,
@@ -123,10 +142,106 @@ static void update_randr_res(struct vdagent_x11 *x11, int poll)
     }
 }
 
+/* Re-fetch only the screen resources, this keeps the output and crtc infos
+   as long as the outputs and crtcs are the same, returns 0 if they are not */
+static int update_randr_screen_res(struct vdagent_x11 *x11)
+{
+    XRRScreenResources *res, *old = x11->randr.res;
+
+    res = XRRGetScreenResourcesCurrent(x11->display, x11->root_window[0]);
+    if (!res)
+        return 0;
+    if (res->noutput != old->noutput || res->ncrtc != old->ncrtc ||
+            memcmp(res->outputs, old->outputs,
+                   res->noutput * sizeof(*res->outputs)) ||
+            memcmp(res->crtcs, old->crtcs, res->ncrtc * sizeof(*res->crtcs))) {
+        XRRFreeScreenResources(res);
+        return 0;
+    }
+    XRRFreeScreenResources(old);
+    x11->randr.res = res;
+    x11->randr.res_dirty = 0;
+    return 1;
+}
+
+/* Bring the cached RandR resources up to date. Only what has been marked
+   dirty, by our own changes or by RRNotify events, gets fetched again, so
+   that a reconfiguration of several monitors does not cost a full round of
+   resource requests for each step. */
+static void refresh_randr_res(struct vdagent_x11 *x11)
+{
+    int i, outputs_changed = 0;
+
+    if (!x11->randr.res ||
+            (x11->randr.res_dirty && !update_randr_screen_res(x11))) {
+        update_randr_res(x11, 0);
+        return;
+    }
+
+    for (i = 0 ; i < x11->randr.res->noutput; ++i) {
+        if (!x11->randr.output_dirty[i])
+            continue;
+        XRRFreeOutputInfo(x11->randr.outputs[i]);
+        x11->randr.outputs[i] = XRRGetOutputInfo(x11->display, x11->randr.res,
+                                                 x11->randr.res->outputs[i]);
+        x11->randr.output_dirty[i] = 0;
+        outputs_changed = 1;
+    }
+    if (outputs_changed)
+        count_monitors(x11);
+
+    for (i = 0 ; i < x11->randr.res->ncrtc; ++i) {
+        if (!x11->randr.crtc_dirty[i])
+            continue;
+        XRRFreeCrtcInfo(x11->randr.crtcs[i]);
+        x11->randr.crtcs[i] = XRRGetCrtcInfo(x11->display, x11->randr.res,
+                                             x11->randr.res->crtcs[i]);
+        x11->randr.crtc_dirty[i] = 0;
+    }
+}
+
+static void mark_output_dirty(struct vdagent_x11 *x11, RROutput output)
+{
+    int i;
+
+    for (i = 0 ; i < x11->randr.res->noutput; ++i) {
+        if (output == x11->randr.res->outputs[i]) {
+            x11->randr.output_dirty[i] = 1;
+            return;
+        }
+    }
+    /* An output we do not know about */
+    x11->randr.res_dirty = 1;
+}
+
+static void mark_crtc_dirty(struct vdagent_x11 *x11, RRCrtc crtc)
+{
+    int i;
+
+    for (i = 0 ; i < x11->randr.res->ncrtc; ++i) {
+        if (crtc == x11->randr.res->crtcs[i]) {
+            x11->randr.crtc_dirty[i] = 1;
+            return;
+        }
+    }
+    x11->randr.res_dirty = 1;
+}
+
+static void mark_all_crtcs_dirty(struct vdagent_x11 *x11)
+{
+    int i;
+
+    for (i = 0 ; i < x11->randr.res->ncrtc; ++i)
+        x11->randr.crtc_dirty[i] = 1;
+}
+
 void vdagent_x11_randr_init(struct vdagent_x11 *x11)
 {
     int i;
 
+    x11->randr.modes = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             NULL, g_free);
+
     if (x11->screen_count > 1) {
         syslog(LOG_WARNING, "X-server has more then 1 screen, "
                "disabling client -> guest resolution syncing");
@@ -140,7 +255,8 @@ void vdagent_x11_randr_init(struct vdagent_x11 *x11)
     }
 
     XRRSelectInput(x11->display, x11->root_window[0],
-        RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+        RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask |
+        RROutputChangeNotifyMask);
 
     if (x11->has_xrandr) {
         update_randr_res(x11, 0);
@@ -201,43 +317,51 @@ find_mode_by_size (struct vdagent_x11 *x11, int output, int width, int height)
     return ret;
 }
 
-static void delete_mode(struct vdagent_x11 *x11, int output_index,
-                        int width, int height)
+static int compare_mode_last_used(const void *a, const void *b)
 {
-    int m;
-    XRRModeInfo *mode;
-    XRROutputInfo *output_info;
-    char name[20];
-
-    if (width == 0 || height == 0)
-        return;
-
-    snprintf(name, sizeof(name), "%dx%d-%d", width, height, output_index);
-    if (x11->debug)
-        syslog(LOG_DEBUG, "Deleting mode %s", name);
+    const struct vdagent_x11_randr_mode *mode_a =
+        *(struct vdagent_x11_randr_mode * const *)a;
+    const struct vdagent_x11_randr_mode *mode_b =
+        *(struct vdagent_x11_randr_mode * const *)b;
+
+    if (mode_a->last_used < mode_b->last_used)
+        return -1;
+    return mode_a->last_used > mode_b->last_used;
+}
 
-    output_info = x11->randr.outputs[output_index];
-    if (output_info->ncrtc != 1) {
-        syslog(LOG_ERR, "output has %d crtcs, expected exactly 1, "
-               "failed to delete mode", output_info->ncrtc);
-        return;
-    }
-    for (m = 0 ; m < x11->randr.res->nmode; ++m) {
-        mode = &x11->randr.res->modes[m];
-        if (strcmp(mode->name, name) == 0)
-            break;
+/* Destroy the least recently used modes we created for output, keeping
+   half of RANDR_MODE_CACHE_SIZE. This is done once in a while rather than
+   on every size change, and for all of these modes in one go. */
+static void collect_modes(struct vdagent_x11 *x11, int output)
+{
+    struct vdagent_x11_randr_mode *modes[RANDR_MODE_CACHE_SIZE + 1];
+    struct vdagent_x11_randr_mode *mode;
+    GHashTableIter iter;
+    int i, count = 0;
+
+    g_hash_table_iter_init(&iter, x11->randr.modes);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&mode)) {
+        if (mode->output == output && count < G_N_ELEMENTS(modes))
+            modes[count++] = mode;
     }
-    if (m < x11->randr.res->nmode) {
-        vdagent_x11_set_error_handler(x11, error_handler);
-        XRRDeleteOutputMode (x11->display, x11->randr.res->outputs[output_index],
-                             mode->id);
-        XRRDestroyMode (x11->display, mode->id);
-	// ignore race error, if mode is created by others
-	vdagent_x11_restore_error_handler(x11);
+    qsort(modes, count, sizeof(modes[0]), compare_mode_last_used);
+
+    vdagent_x11_set_error_handler(x11, error_handler);
+    for (i = 0; i < count - RANDR_MODE_CACHE_SIZE / 2; i++) {
+        if (x11->debug)
+            syslog(LOG_DEBUG, "Deleting mode %lu of output %d",
+                   (unsigned long)modes[i]->id, output);
+        XRRDeleteOutputMode(x11->display, x11->randr.res->outputs[output],
+                            modes[i]->id);
+        XRRDestroyMode(x11->display, modes[i]->id);
+        g_hash_table_remove(x11->randr.modes, &modes[i]->key);
+        x11->randr.mode_count[output]--;
     }
+    // ignore race error, if mode is deleted by others
+    vdagent_x11_restore_error_handler(x11);
 
-    /* silly to update everytime for more then one monitor */
-    update_randr_res(x11, 0);
+    x11->randr.output_dirty[output] = 1;
+    x11->randr.res_dirty = 1;
 }
 
 static void set_reduced_cvt_mode(XRRModeInfo *mode, int width, int height)
@@ -315,11 +439,13 @@ static void set_reduced_cvt_mode(XRRModeInfo *mode, int width, int height)
 
 }
 
-static XRRModeInfo *create_new_mode(struct vdagent_x11 *x11, int output_index,
-                                    int width, int height)
+/* Returns the id of the new mode, or None */
+static RRMode create_new_mode(struct vdagent_x11 *x11, int output_index,
+                              int width, int height)
 {
     char modename[20];
     XRRModeInfo mode;
+    RRMode id;
 
     snprintf(modename, sizeof(modename), "%dx%d-%d", width, height, output_index);
     mode.hSkew = 0;
@@ -329,25 +455,96 @@ static XRRModeInfo *create_new_mode(struct vdagent_x11 *x11, int output_index,
     mode.modeFlags = 0;
     mode.id = 0;
     vdagent_x11_set_error_handler(x11, error_handler);
-    XRRCreateMode (x11->display, x11->root_window[0], &mode);
-    // ignore race error, if mode is created by others
-    vdagent_x11_restore_error_handler(x11);
+    id = XRRCreateMode (x11->display, x11->root_window[0], &mode);
+    /* The new mode is not in our copy of the resources, but we have its id,
+       so these only need to be fetched again once someone wants them */
+    x11->randr.res_dirty = 1;
+    if (vdagent_x11_restore_error_handler(x11)) {
+        // race error, if mode is created by others, then use theirs
+        XRRModeInfo *existing;
+
+        refresh_randr_res(x11);
+        existing = find_mode_by_name(x11, modename);
+        id = existing ? existing->id : None;
+    }
+
+    return id;
+}
 
-    /* silly to update everytime for more then one monitor */
-    update_randr_res(x11, 0);
+/* Returns the id of a mode of width x height for output, which is added to
+   the output, or None. Modes we created are looked up in the mode cache,
+   without going through all modes of the output. */
+static int output_has_mode(struct vdagent_x11 *x11, int output, RRMode id)
+{
+    int m;
 
-    return find_mode_by_name(x11, modename);
+    if (!mode_from_id(x11, id))
+        return 0;
+    for (m = 0; m < x11->randr.outputs[output]->nmode; m++) {
+        if (x11->randr.outputs[output]->modes[m] == id)
+            return 1;
+    }
+    return 0;
+}
+
+static RRMode get_mode(struct vdagent_x11 *x11, int output,
+                       int width, int height)
+{
+    guint64 key = RANDR_MODE_KEY(output, width, height);
+    struct vdagent_x11_randr_mode *cached;
+    XRRModeInfo *mode;
+    RRMode id;
+    char modename[20];
+
+    /* Someone else may have destroyed the mode, or a re-probe of the
+       outputs may have dropped it, then it has to be created again */
+    cached = g_hash_table_lookup(x11->randr.modes, &key);
+    if (cached && !output_has_mode(x11, output, cached->id)) {
+        g_hash_table_remove(x11->randr.modes, &key);
+        x11->randr.mode_count[output]--;
+        cached = NULL;
+    }
+    if (cached) {
+        cached->last_used = ++x11->randr.mode_use_count;
+        return cached->id;
+    }
+
+    /* A mode of the driver, or one we created before we (re)started, for
+       the latter the name tells */
+    snprintf(modename, sizeof(modename), "%dx%d-%d", width, height, output);
+    mode = find_mode_by_size(x11, output, width, height);
+    if (mode && strcmp(mode->name, modename) != 0)
+        return mode->id;
+
+    if (mode) {
+        id = mode->id;
+    } else {
+        id = create_new_mode(x11, output, width, height);
+        if (id == None)
+            return None;
+        XRRAddOutputMode(x11->display, x11->randr.res->outputs[output], id);
+        x11->randr.output_dirty[output] = 1;
+    }
+
+    cached = g_new0(struct vdagent_x11_randr_mode, 1);
+    cached->key = key;
+    cached->id = id;
+    cached->output = output;
+    cached->last_used = ++x11->randr.mode_use_count;
+    g_hash_table_insert(x11->randr.modes, &cached->key, cached);
+    if (++x11->randr.mode_count[output] > RANDR_MODE_CACHE_SIZE)
+        collect_modes(x11, output);
+
+    return id;
 }
 
 static int xrandr_add_and_set(struct vdagent_x11 *x11, int output, int x, int y,
                               int width, int height)
 {
-    XRRModeInfo *mode;
+    RRMode mode_id;
     int xid;
     Status s;
     RROutput outputs[1];
-    int old_width  = x11->randr.monitor_sizes[output].width;
-    int old_height = x11->randr.monitor_sizes[output].height;
 
     if (!x11->randr.res || output >= x11->randr.res->noutput || output < 0) {
         syslog(LOG_ERR, "%s: program error: missing RANDR or bad output",
@@ -358,33 +555,28 @@ static int xrandr_add_and_set(struct vdagent_x11 *x11, int output, int x, int y,
         /* fail, set_best_mode will find something close. */
         return 0;
     }
+    /* Earlier steps may have changed the modes of this output */
+    refresh_randr_res(x11);
     xid = x11->randr.res->outputs[output];
-    mode = find_mode_by_size(x11, output, width, height);
-    if (!mode) {
-        mode = create_new_mode(x11, output, width, height);
-    }
-    if (!mode) {
+    mode_id = get_mode(x11, output, width, height);
+    if (mode_id == None) {
         syslog(LOG_ERR, "failed to add a new mode");
         return 0;
     }
-    XRRAddOutputMode(x11->display, xid, mode->id);
     x11->randr.monitor_sizes[output].width = width;
     x11->randr.monitor_sizes[output].height = height;
     outputs[0] = xid;
     vdagent_x11_set_error_handler(x11, error_handler);
     s = XRRSetCrtcConfig(x11->display, x11->randr.res, x11->randr.res->crtcs[output],
-                         CurrentTime, x, y, mode->id, RR_Rotate_0, outputs,
+                         CurrentTime, x, y, mode_id, RR_Rotate_0, outputs,
                          1);
+    mark_crtc_dirty(x11, x11->randr.res->crtcs[output]);
     if (vdagent_x11_restore_error_handler(x11) || (s != RRSetConfigSuccess)) {
         syslog(LOG_ERR, "failed to XRRSetCrtcConfig");
         x11->set_crtc_config_not_functional = 1;
         return 0;
     }
 
-    /* clean the previous name, if any */
-    if (width != old_width || height != old_height)
-        delete_mode(x11, output, old_width, old_height);
-
     return 1;
 }
 
@@ -402,12 +594,11 @@ static void xrandr_disable_output(struct vdagent_x11 *x11, int output)
                          x11->randr.res->crtcs[output],
                          CurrentTime, 0, 0, None, RR_Rotate_0,
                          NULL, 0);
+    mark_crtc_dirty(x11, x11->randr.res->crtcs[output]);
 
     if (s != RRSetConfigSuccess)
         syslog(LOG_ERR, "failed to disable monitor");
 
-    delete_mode(x11, output, x11->randr.monitor_sizes[output].width,
-                             x11->randr.monitor_sizes[output].height);
     x11->randr.monitor_sizes[output].width  = 0;
     x11->randr.monitor_sizes[output].height = 0;
 }
@@ -458,6 +649,7 @@ static int set_screen_to_best_size(struct vdagent_x11 *x11, int width, int heigh
     XRRSetScreenConfig(x11->display, config, x11->root_window[0], best,
                        rotation, CurrentTime);
     XRRFreeScreenConfigInfo(config);
+    mark_all_crtcs_dirty(x11);
 
     if (x11->debug)
         syslog(LOG_DEBUG, "set_screen_to_best_size set size to: %dx%d\n",
@@ -470,7 +662,7 @@ static int set_screen_to_best_size(struct vdagent_x11 *x11, int width, int heigh
 void vdagent_x11_randr_handle_root_size_change(struct vdagent_x11 *x11,
     int screen, int width, int height)
 {
-    update_randr_res(x11, 0);
+    refresh_randr_res(x11);
 
     if (width == x11->width[screen] && height == x11->height[screen]) {
         return;
@@ -496,12 +688,32 @@ int vdagent_x11_randr_handle_event(struct vdagent_x11 *x11,
         case RRScreenChangeNotify: {
             XRRScreenChangeNotifyEvent *sce =
                 (XRRScreenChangeNotifyEvent *) &event;
+            /* A new config timestamp means the outputs got re-probed */
+            if (x11->randr.res &&
+                    sce->config_timestamp != x11->randr.res->configTimestamp)
+                x11->randr.res_dirty = 1;
             vdagent_x11_randr_handle_root_size_change(x11, 0,
                 sce->width, sce->height);
             break;
         }
         case RRNotify: {
-            update_randr_res(x11, 0);
+            XRRNotifyEvent *ne = (XRRNotifyEvent *) &event;
+
+            if (x11->randr.res) {
+                switch (ne->subtype) {
+                case RRNotify_CrtcChange:
+                    mark_crtc_dirty(x11,
+                                    ((XRRCrtcChangeNotifyEvent *)ne)->crtc);
+                    break;
+                case RRNotify_OutputChange:
+                    mark_output_dirty(x11,
+                                ((XRROutputChangeNotifyEvent *)ne)->output);
+                    break;
+                default:
+                    x11->randr.res_dirty = 1;
+                    break;
+                }
+            }
             if (!x11->dont_send_guest_xorg_res)
                 vdagent_x11_send_daemon_guest_xorg_res(x11, 1);
             break;
@@ -642,6 +854,12 @@ static int same_monitor_configs(VDAgentMonitorsConfig *conf1,
     return 1;
 }
 
+static int same_monitor(VDAgentMonConfig *mon1, VDAgentMonConfig *mon2)
+{
+    return mon1->x == mon2->x && mon1->y == mon2->y &&
+           mon1->width == mon2->width && mon1->height == mon2->height;
+}
+
 static int config_size(int num_of_monitors)
 {
     return sizeof(VDAgentMonitorsConfig) +
@@ -726,6 +944,7 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
 {
     int primary_w, primary_h;
     int i, real_num_of_monitors = 0;
+    int needs_set[MONITOR_SIZE_COUNT];
     VDAgentMonitorsConfig *curr = NULL;
 
     if (!x11->has_xrandr)
@@ -746,7 +965,7 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
     }
     mon_config->num_of_monitors = real_num_of_monitors;
 
-    update_randr_res(x11, 0);
+    refresh_randr_res(x11);
     if (mon_config->num_of_monitors > x11->randr.res->noutput) {
         syslog(LOG_WARNING,
                "warning unexpected client request: #mon %d > driver output %d",
@@ -785,35 +1004,46 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
     g_unlink(config);
     g_free(config);
 
-    for (i = mon_config->num_of_monitors; i < x11->randr.res->noutput; i++)
-        xrandr_disable_output(x11, i);
-
-    /* First, disable disabled CRTCs... */
-    for (i = 0; i < mon_config->num_of_monitors; ++i) {
-        if (!monitor_enabled(&mon_config->monitors[i])) {
-            xrandr_disable_output(x11, i);
+    /* Apply all changes in one go under a server grab, so that other
+     * clients do not see nor react to the intermediate states. */
+    XGrabServer(x11->display);
+
+    /* First, disable disabled CRTCs, leaving the ones which already are
+     * alone, and plan which CRTCs need to be set. Monitors which keep
+     * their size and position are not touched at all... */
+    for (i = 0; i < x11->randr.res->noutput; i++) {
+        VDAgentMonConfig *cur = NULL, *mon = NULL;
+
+        if (i < curr->num_of_monitors &&
+                monitor_enabled(&curr->monitors[i]))
+            cur = &curr->monitors[i];
+        if (i < mon_config->num_of_monitors) {
+            needs_set[i] = 0;
+            if (monitor_enabled(&mon_config->monitors[i]))
+                mon = &mon_config->monitors[i];
         }
-    }
 
-    /* ... and disable the ones that would be bigger than
-     * the new RandR screen once it is resized. If they are enabled the
-     * XRRSetScreenSize call will fail with BadMatch. They will be
-     * reenabled after hanging the screen size.
-     */
-    for (i = 0; i < curr->num_of_monitors; ++i) {
-        int width, height;
-        int x, y;
-
-        width = curr->monitors[i].width;
-        height = curr->monitors[i].height;
-        x = curr->monitors[i].x;
-        y = curr->monitors[i].y;
-
-        if ((x + width > primary_w) || (y + height > primary_h)) {
+        if (!mon) {
+            if (cur)
+                xrandr_disable_output(x11, i);
+            continue;
+        }
+        if (cur && same_monitor(cur, mon))
+            continue;
+        needs_set[i] = 1;
+
+        /* ... and disable the ones that would be bigger than
+         * the new RandR screen once it is resized. If they are enabled the
+         * XRRSetScreenSize call will fail with BadMatch. They will be
+         * reenabled after hanging the screen size.
+         */
+        if (cur && ((cur->x + cur->width > primary_w) ||
+                    (cur->y + cur->height > primary_h))) {
             if (x11->debug)
                 syslog(LOG_DEBUG, "Disabling monitor %d: "
                        "%dx%d+%d+%d > (%d,%d)",
-                       i, width, height, x, y, primary_w, primary_h);
+                       i, cur->width, cur->height, cur->x, cur->y,
+                       primary_w, primary_h);
 
             xrandr_disable_output(x11, i);
         }
@@ -834,6 +1064,7 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
         if (vdagent_x11_restore_error_handler(x11)) {
             syslog(LOG_ERR, "XRRSetScreenSize failed, not enough mem?");
             if (!fallback) {
+                XUngrabServer(x11->display);
                 syslog(LOG_WARNING, "Restoring previous config");
                 vdagent_x11_set_monitor_config(x11, curr, 1);
                 free(curr);
@@ -856,7 +1087,7 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
         int width, height;
         int x, y;
 
-        if (!monitor_enabled(&mon_config->monitors[i])) {
+        if (!needs_set[i]) {
             continue;
         }
         /* Try to create the requested resolution */
@@ -872,8 +1103,11 @@ void vdagent_x11_set_monitor_config(struct vdagent_x11 *x11,
         }
     }
 
-    update_randr_res(x11,
-        x11->randr.num_monitors != enabled_monitors(mon_config));
+    XUngrabServer(x11->display);
+
+    refresh_randr_res(x11);
+    if (x11->randr.num_monitors != enabled_monitors(mon_config))
+        update_randr_res(x11, 1);
     x11->width[0] = primary_w;
     x11->height[0] = primary_h;
 
@@ -899,7 +1133,7 @@ void vdagent_x11_send_daemon_guest_xorg_res(struct vdagent_x11 *x11, int update)
         VDAgentMonitorsConfig *curr;
 
         if (update)
-            update_randr_res(x11, 0);
+            refresh_randr_res(x11);
 
         curr = get_current_mon_config(x11);
         if (!curr)
@@ -42,6 +42,7 @@
 #include <X11/Xlib.h>
 #include <X11/extensions/Xfixes.h>
 #include "vdagentd-proto.h"
+#include "vdagent-image.h"
 #include "vdagent-x11.h"
 #include "vdagent-x11-priv.h"
 
@@ -51,15 +52,27 @@ int vdagent_x11_caught_error;
 
 static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
                                                 XEvent *event, int incr);
-static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11);
+static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11,
+                                                 XEvent *event);
 static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
                                               XEvent *event);
 static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
                                                       XEvent *del_event);
 static void vdagent_x11_send_selection_notify(struct vdagent_x11 *x11,
-                Atom prop, struct vdagent_x11_selection_request *request);
+                                              Atom prop, XEvent *event);
+static void vdagent_x11_send_clipboard_buffer(struct vdagent_x11 *x11,
+    uint8_t selection, XEvent *event, struct vdagent_x11_clipboard_buffer *buf);
 static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
                                             uint8_t selection, int new_owner);
+static void vdagent_x11_incr_send_free(gpointer data);
+static int vdagent_x11_incr_send_next(struct vdagent_x11 *x11,
+                                      struct vdagent_x11_incr_send *incr);
+static int vdagent_x11_type_to_format(uint32_t type);
+static struct vdagent_x11_clipboard_buffer *vdagent_x11_clipboard_buffer_convert(
+    struct vdagent_x11 *x11, uint8_t selection,
+    struct vdagent_x11_clipboard_buffer *buf, uint32_t type);
+static uint32_t vdagent_x11_target_to_type(struct vdagent_x11 *x11,
+                                           uint8_t selection, Atom target);
 
 static const char *vdagent_x11_sel_to_str(uint8_t selection) {
     switch (selection) {
@@ -173,12 +186,54 @@ static void vdagent_x11_get_wm_name(struct vdagent_x11 *x11)
     vdagent_x11_restore_error_handler(x11);
 }
 
+/* Intern all atoms we need in a single round trip, and remember their
+   names while we are at it */
+static void vdagent_x11_intern_atoms(struct vdagent_x11 *x11)
+{
+    char *names[6 + clipboard_format_count * 16];
+    Atom *dest[6 + clipboard_format_count * 16];
+    Atom atoms[6 + clipboard_format_count * 16];
+    int i, j, n = 0;
+
+    names[n] = "CLIPBOARD"; dest[n++] = &x11->clipboard_atom;
+    names[n] = "PRIMARY";   dest[n++] = &x11->clipboard_primary_atom;
+    names[n] = "TARGETS";   dest[n++] = &x11->targets_atom;
+    names[n] = "INCR";      dest[n++] = &x11->incr_atom;
+    names[n] = "MULTIPLE";  dest[n++] = &x11->multiple_atom;
+    names[n] = "TIMESTAMP"; dest[n++] = &x11->timestamp_atom;
+    for(i = 0; i < clipboard_format_count; i++) {
+        x11->clipboard_formats[i].type = clipboard_format_templates[i].type;
+        for(j = 0; clipboard_format_templates[i].atom_names[j]; j++) {
+            names[n] = (char *)clipboard_format_templates[i].atom_names[j];
+            dest[n++] = &x11->clipboard_formats[i].atoms[j];
+        }
+        x11->clipboard_formats[i].atom_count = j;
+    }
+
+    XInternAtoms(x11->display, names, n, False, atoms);
+    for (i = 0; i < n; i++) {
+        *dest[i] = atoms[i];
+        g_hash_table_insert(x11->atom_names, GUINT_TO_POINTER(atoms[i]),
+                            g_strdup(names[i]));
+    }
+
+    for (i = 0; i < clipboard_format_count; i++) {
+        for (j = 0; j < x11->clipboard_formats[i].atom_count; j++) {
+            gpointer key = GUINT_TO_POINTER(x11->clipboard_formats[i].atoms[j]);
+
+            if (!g_hash_table_lookup(x11->target_formats, key))
+                g_hash_table_insert(x11->target_formats, key,
+                                    TARGET_FORMAT_VALUE(i, j));
+        }
+    }
+}
+
 struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
-    int debug, int sync)
+    int debug, int sync, uint32_t clipboard_retain)
 {
     struct vdagent_x11 *x11;
     XWindowAttributes attrib;
-    int i, j, major, minor;
+    int i, major, minor;
 
     x11 = calloc(1, sizeof(*x11));
     if (!x11) {
@@ -188,10 +243,19 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
 
     x11->vdagentd = vdagentd;
     x11->debug = debug;
+    x11->atom_names = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+    x11->target_formats = g_hash_table_new(g_direct_hash, g_direct_equal);
+    x11->clipboard_data_retain = clipboard_retain;
+    x11->incr_sends = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                            NULL, vdagent_x11_incr_send_free);
 
     x11->display = XOpenDisplay(NULL);
     if (!x11->display) {
         syslog(LOG_ERR, "could not connect to X-server");
+        g_hash_table_destroy(x11->target_formats);
+        g_hash_table_destroy(x11->atom_names);
+        g_hash_table_destroy(x11->incr_sends);
         free(x11);
         return NULL;
     }
@@ -201,6 +265,9 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
         syslog(LOG_ERR, "Error too much screens: %d > %d",
                x11->screen_count, MAX_SCREENS);
         XCloseDisplay(x11->display);
+        g_hash_table_destroy(x11->target_formats);
+        g_hash_table_destroy(x11->atom_names);
+        g_hash_table_destroy(x11->incr_sends);
         free(x11);
         return NULL;
     }
@@ -213,22 +280,7 @@ struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
     for (i = 0; i < x11->screen_count; i++)
         x11->root_window[i] = RootWindow(x11->display, i);
     x11->fd = ConnectionNumber(x11->display);
-    x11->clipboard_atom = XInternAtom(x11->display, "CLIPBOARD", False);
-    x11->clipboard_primary_atom = XInternAtom(x11->display, "PRIMARY", False);
-    x11->targets_atom = XInternAtom(x11->display, "TARGETS", False);
-    x11->incr_atom = XInternAtom(x11->display, "INCR", False);
-    x11->multiple_atom = XInternAtom(x11->display, "MULTIPLE", False);
-    x11->timestamp_atom = XInternAtom(x11->display, "TIMESTAMP", False);
-    for(i = 0; i < clipboard_format_count; i++) {
-        x11->clipboard_formats[i].type = clipboard_format_templates[i].type;
-        for(j = 0; clipboard_format_templates[i].atom_names[j]; j++) {
-            x11->clipboard_formats[i].atoms[j] =
-                XInternAtom(x11->display,
-                            clipboard_format_templates[i].atom_names[j],
-                            False);
-        }
-        x11->clipboard_formats[i].atom_count = j;
-    }
+    vdagent_x11_intern_atoms(x11);
 
     /* We should not store properties (for selections) on the root window */
     x11->selection_window = XCreateSimpleWindow(x11->display, x11->root_window[0],
@@ -303,11 +355,15 @@ void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected)
     if (vdagentd_disconnected)
         x11->vdagentd = NULL;
 
-    for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; ++sel) {
+    for (sel = 0; sel < SELECTION_COUNT; ++sel) {
         vdagent_x11_set_clipboard_owner(x11, sel, owner_none);
     }
 
     XCloseDisplay(x11->display);
+    g_hash_table_destroy(x11->target_formats);
+    g_hash_table_destroy(x11->atom_names);
+    g_hash_table_destroy(x11->incr_sends);
+    g_hash_table_destroy(x11->randr.modes);
     g_free(x11->net_wm_name);
     free(x11->randr.failed_conf);
     free(x11);
@@ -318,57 +374,357 @@ int vdagent_x11_get_fd(struct vdagent_x11 *x11)
     return x11->fd;
 }
 
-static void vdagent_x11_next_selection_request(struct vdagent_x11 *x11)
-{
-    struct vdagent_x11_selection_request *selection_request;
-    selection_request = x11->selection_req;
-    x11->selection_req = selection_request->next;
-    free(selection_request);
-}
-
 static void vdagent_x11_next_conversion_request(struct vdagent_x11 *x11)
 {
     struct vdagent_x11_conversion_request *conversion_req;
     conversion_req = x11->conversion_req;
     x11->conversion_req = conversion_req->next;
+    if (!x11->conversion_req)
+        x11->conversion_req_tail = NULL;
     free(conversion_req);
 }
 
+static struct vdagent_x11_clipboard_buffer *vdagent_x11_clipboard_buffer_new(
+    uint32_t type, uint8_t *data, uint32_t size)
+{
+    struct vdagent_x11_clipboard_buffer *buf;
+
+    buf = malloc(sizeof(*buf));
+    if (!buf) {
+        free(data);
+        return NULL;
+    }
+    buf->ref = 1;
+    buf->complete = 1;
+    buf->type = type;
+    buf->data = data;
+    buf->size = size;
+    buf->space = size;
+    return buf;
+}
+
+/* Append more data to a buffer which is still coming in from the client */
+static int vdagent_x11_clipboard_buffer_append(
+    struct vdagent_x11_clipboard_buffer *buf, const uint8_t *data,
+    uint32_t size)
+{
+    uint8_t *new_data;
+    uint32_t space;
+
+    if (size > UINT32_MAX - buf->size)
+        return -1;
+
+    if (buf->size + size > buf->space) {
+        space = buf->space > UINT32_MAX / 2 ? UINT32_MAX : buf->space * 2;
+        if (space < buf->size + size)
+            space = buf->size + size;
+        new_data = realloc(buf->data, space);
+        if (!new_data)
+            return -1;
+        buf->data = new_data;
+        buf->space = space;
+    }
+
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return 0;
+}
+
+static void vdagent_x11_clipboard_buffer_unref(
+    struct vdagent_x11_clipboard_buffer *buf)
+{
+    if (buf && --buf->ref == 0) {
+        free(buf->data);
+        free(buf);
+    }
+}
+
+static void vdagent_x11_incr_send_free(gpointer data)
+{
+    struct vdagent_x11_incr_send *incr = data;
+
+    vdagent_x11_clipboard_buffer_unref(incr->data);
+    free(incr);
+}
+
+static gboolean vdagent_x11_incr_send_has_selection(gpointer key,
+    gpointer value, gpointer user_data)
+{
+    struct vdagent_x11_incr_send *incr = value;
+
+    return incr->selection == *(uint8_t *)user_data;
+}
+
+struct vdagent_x11_incr_send_wakeup {
+    struct vdagent_x11 *x11;
+    struct vdagent_x11_clipboard_buffer *buf;
+};
+
+static gboolean vdagent_x11_incr_send_abort(gpointer key,
+    gpointer value, gpointer user_data)
+{
+    struct vdagent_x11_incr_send *incr = value;
+    struct vdagent_x11_incr_send_wakeup *wakeup = user_data;
+
+    if (incr->data != wakeup->buf)
+        return FALSE;
+
+    /* The requestor still needs the closing 0 sized property, if it has
+       not taken the last part yet, this gets sent on its property delete */
+    incr->aborted = 1;
+    if (!incr->waiting)
+        return FALSE;
+
+    return vdagent_x11_incr_send_next(wakeup->x11, incr);
+}
+
+static gboolean vdagent_x11_incr_send_wakeup(gpointer key,
+    gpointer value, gpointer user_data)
+{
+    struct vdagent_x11_incr_send *incr = value;
+    struct vdagent_x11_incr_send_wakeup *wakeup = user_data;
+
+    if (!incr->waiting || incr->data != wakeup->buf)
+        return FALSE;
+
+    return vdagent_x11_incr_send_next(wakeup->x11, incr);
+}
+
+/* Continue incr sends which were waiting for more data to arrive in buf */
+static void vdagent_x11_incr_sends_wakeup(struct vdagent_x11 *x11,
+    struct vdagent_x11_clipboard_buffer *buf)
+{
+    struct vdagent_x11_incr_send_wakeup wakeup = { x11, buf };
+
+    g_hash_table_foreach_remove(x11->incr_sends,
+                                vdagent_x11_incr_send_wakeup, &wakeup);
+}
+
+/* Drop client data which was still coming in, incr sends of it can not be
+   completed, so they get ended early */
+static void vdagent_x11_client_stream_abort(struct vdagent_x11 *x11)
+{
+    struct vdagent_x11_incr_send_wakeup abort = { x11, x11->client_stream };
+
+    if (!x11->client_stream)
+        return;
+
+    g_hash_table_foreach_remove(x11->incr_sends,
+                                vdagent_x11_incr_send_abort, &abort);
+    vdagent_x11_clipboard_buffer_unref(x11->client_stream);
+    x11->client_stream = NULL;
+}
+
+/* Answer all queued selection requests for selection waiting for client
+   data of type with the data in buf, or refuse them if buf is NULL.
+   VD_AGENT_CLIPBOARD_NONE as type matches requests for any type. Requests
+   for another type get the data converted, once buf is complete. Returns
+   the number of requests which got answered. */
+static int vdagent_x11_answer_selection_requests(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, struct vdagent_x11_clipboard_buffer *buf)
+{
+    struct vdagent_x11_selection_request *prev, *curr, *next;
+    struct vdagent_x11_clipboard_buffer *converted[clipboard_format_count];
+    struct vdagent_x11_clipboard_buffer *answer;
+    unsigned int convert_failed = 0;
+    int i, count = 0;
+
+    memset(converted, 0, sizeof(converted));
+    prev = NULL;
+    next = x11->selection_req;
+    while (next) {
+        curr = next;
+        next = curr->next;
+        if (curr->selection != selection ||
+                (type != VD_AGENT_CLIPBOARD_NONE && curr->source != type)) {
+            prev = curr;
+            continue;
+        }
+
+        answer = buf;
+        if (buf && curr->type != buf->type) {
+            /* Converting needs all of the data */
+            if (!buf->complete) {
+                prev = curr;
+                continue;
+            }
+            i = vdagent_x11_type_to_format(curr->type);
+            if (!converted[i] && !(convert_failed & (1 << i))) {
+                converted[i] = vdagent_x11_clipboard_buffer_convert(x11,
+                                                    selection, buf, curr->type);
+                if (!converted[i])
+                    convert_failed |= 1 << i;
+            }
+            answer = converted[i];
+        }
+
+        if (prev)
+            prev->next = next;
+        else
+            x11->selection_req = next;
+
+        if (answer)
+            vdagent_x11_send_clipboard_buffer(x11, selection,
+                                              &curr->event, answer);
+        else
+            vdagent_x11_send_selection_notify(x11, None, &curr->event);
+        free(curr);
+        count++;
+    }
+    x11->selection_req_tail = prev;
+
+    for (i = 0; i < clipboard_format_count; i++)
+        vdagent_x11_clipboard_buffer_unref(converted[i]);
+
+    return count;
+}
+
+static int vdagent_x11_type_to_format(uint32_t type)
+{
+    int i;
+
+    for (i = 0; i < clipboard_format_count; i++)
+        if (clipboard_format_templates[i].type == type)
+            return i;
+    return -1;
+}
+
+static struct vdagent_x11_clipboard_buffer *vdagent_x11_clipboard_cache_lookup(
+    struct vdagent_x11 *x11, uint8_t selection, uint32_t type)
+{
+    int format = vdagent_x11_type_to_format(type);
+
+    return format == -1 ? NULL : x11->selections[selection].cache[format];
+}
+
+static void vdagent_x11_clipboard_cache_store(struct vdagent_x11 *x11,
+    uint8_t selection, struct vdagent_x11_clipboard_buffer *buf)
+{
+    int format = vdagent_x11_type_to_format(buf->type);
+
+    if (format == -1 || !buf->complete || buf->size == 0 ||
+            buf->size > CLIPBOARD_CACHE_MAX_SIZE)
+        return;
+
+    vdagent_x11_clipboard_buffer_unref(x11->selections[selection].cache[format]);
+    buf->ref++;
+    x11->selections[selection].cache[format] = buf;
+}
+
+static void vdagent_x11_clipboard_cache_clear(struct vdagent_x11 *x11,
+    uint8_t selection)
+{
+    int i;
+
+    for (i = 0; i < clipboard_format_count; i++) {
+        vdagent_x11_clipboard_buffer_unref(x11->selections[selection].cache[i]);
+        x11->selections[selection].cache[i] = NULL;
+    }
+}
+
+/* Convert the image data in buf to type. The converted data gets cached
+   just like data from the client. Returns a new reference to the converted
+   data, or NULL on failure. */
+static struct vdagent_x11_clipboard_buffer *vdagent_x11_clipboard_buffer_convert(
+    struct vdagent_x11 *x11, uint8_t selection,
+    struct vdagent_x11_clipboard_buffer *buf, uint32_t type)
+{
+    struct vdagent_x11_clipboard_buffer *converted;
+    uint8_t *data;
+    uint32_t size;
+
+    converted = vdagent_x11_clipboard_cache_lookup(x11, selection, type);
+    if (converted) {
+        converted->ref++;
+        return converted;
+    }
+
+    if (vdagent_image_convert(buf->type, buf->data, buf->size, type,
+                              &data, &size)) {
+        SELPRINTF("failed to convert clipboard data from type %u to %u",
+                  buf->type, type);
+        return NULL;
+    }
+    VSELPRINTF("converted clipboard data from type %u to %u, %u -> %u bytes",
+               buf->type, type, buf->size, size);
+
+    converted = vdagent_x11_clipboard_buffer_new(type, data, size);
+    if (!converted) {
+        SELPRINTF("out of memory allocating clipboard buffer");
+        return NULL;
+    }
+    vdagent_x11_clipboard_cache_store(x11, selection, converted);
+    return converted;
+}
+
+/* Image types in the order in which we prefer to convert from them, the
+   lossless ones first, with png as the smallest of those */
+static const uint32_t vdagent_x11_image_types[] = {
+    VD_AGENT_CLIPBOARD_IMAGE_PNG,
+    VD_AGENT_CLIPBOARD_IMAGE_BMP,
+    VD_AGENT_CLIPBOARD_IMAGE_TIFF,
+    VD_AGENT_CLIPBOARD_IMAGE_JPG,
+};
+
+#define image_type_count \
+    (sizeof(vdagent_x11_image_types)/sizeof(vdagent_x11_image_types[0]))
+
+static int vdagent_x11_selection_find_type(struct vdagent_x11_selection *sel,
+                                           uint32_t type)
+{
+    int i;
+
+    for (i = 0; i < sel->type_count; i++)
+        if (sel->agent_types[i] == type)
+            return i;
+    return -1;
+}
+
+/* Offer type for selection by converting an image type which is on offer,
+   returns 1 if it was added. The x11 target of a converted type is that of
+   the data we convert from. */
+static int vdagent_x11_selection_add_converted_type(
+    struct vdagent_x11_selection *sel, uint32_t type)
+{
+    int i, j;
+
+    if (vdagent_x11_selection_find_type(sel, type) != -1)
+        return 0;
+
+    for (i = 0; i < image_type_count; i++) {
+        j = vdagent_x11_selection_find_type(sel, vdagent_x11_image_types[i]);
+        if (j == -1 || sel->source_types[j] != sel->agent_types[j] ||
+                !vdagent_image_can_convert(sel->agent_types[j], type))
+            continue;
+
+        sel->agent_types[sel->type_count] = type;
+        sel->source_types[sel->type_count] = sel->agent_types[j];
+        sel->x11_targets[sel->type_count] = sel->x11_targets[j];
+        sel->type_count++;
+        return 1;
+    }
+    return 0;
+}
+
 static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
     uint8_t selection, int new_owner)
 {
-    struct vdagent_x11_selection_request *prev_sel, *curr_sel, *next_sel;
     struct vdagent_x11_conversion_request *prev_conv, *curr_conv, *next_conv;
     int once;
 
     /* Clear pending requests and clipboard data */
-    once = 1;
-    prev_sel = NULL;
-    next_sel = x11->selection_req;
-    while (next_sel) {
-        curr_sel = next_sel;
-        next_sel = curr_sel->next;
-        if (curr_sel->selection == selection) {
-            if (once) {
-                SELPRINTF("selection requests pending on clipboard ownership "
-                          "change, clearing");
-                once = 0;
-            }
-            vdagent_x11_send_selection_notify(x11, None, curr_sel);
-            if (curr_sel == x11->selection_req) {
-                x11->selection_req = next_sel;
-                free(x11->selection_req_data);
-                x11->selection_req_data = NULL;
-                x11->selection_req_data_pos = 0;
-                x11->selection_req_data_size = 0;
-                x11->selection_req_atom = None;
-            } else {
-                prev_sel->next = next_sel;
-            }
-            free(curr_sel);
-        } else {
-            prev_sel = curr_sel;
-        }
+    if (vdagent_x11_answer_selection_requests(x11, selection,
+                                              VD_AGENT_CLIPBOARD_NONE, NULL))
+        SELPRINTF("selection requests pending on clipboard ownership "
+                  "change, cleared");
+    if (g_hash_table_foreach_remove(x11->incr_sends,
+                                    vdagent_x11_incr_send_has_selection,
+                                    &selection))
+        SELPRINTF("incr sends in progress on clipboard ownership "
+                  "change, aborted");
+    if (x11->client_stream_selection == selection) {
+        vdagent_x11_client_stream_abort(x11);
+        x11->client_stream_dropped = 0;
     }
 
     once = 1;
@@ -398,17 +754,20 @@ static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
             prev_conv = curr_conv;
         }
     }
+    x11->conversion_req_tail = prev_conv;
 
     if (new_owner == owner_none) {
         /* When going from owner_guest to owner_none we need to send a
            clipboard release message to the client */
-        if (x11->clipboard_owner[selection] == owner_guest && x11->vdagentd) {
+        if (x11->selections[selection].owner == owner_guest && x11->vdagentd) {
             udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_RELEASE, selection,
                         0, NULL, 0);
         }
-        x11->clipboard_type_count[selection] = 0;
+        x11->selections[selection].type_count = 0;
     }
-    x11->clipboard_owner[selection] = new_owner;
+    /* Whoever owns the selection now, the data we have cached is stale */
+    vdagent_x11_clipboard_cache_clear(x11, selection);
+    x11->selections[selection].owner = new_owner;
 }
 
 static int vdagent_x11_get_clipboard_atom(struct vdagent_x11 *x11, uint8_t selection, Atom* clipboard)
@@ -499,7 +858,7 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
         XConvertSelection(x11->display, ev.xfev.selection, x11->targets_atom,
                           x11->targets_atom, x11->selection_window,
                           CurrentTime);
-        x11->expected_targets_notifies[selection]++;
+        x11->selections[selection].expected_targets_notifies++;
         return;
     }
 
@@ -535,8 +894,8 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
                                 event.xproperty.state == PropertyNewValue) {
             vdagent_x11_handle_selection_notify(x11, &event, 1);
         }
-        if (x11->selection_req_data &&
-                                 event.xproperty.state == PropertyDelete) {
+        if (event.xproperty.state == PropertyDelete &&
+                                 g_hash_table_size(x11->incr_sends)) {
             vdagent_x11_handle_property_delete_notify(x11, &event);
         }
         /* Always mark as handled, since we cannot unselect input for property
@@ -548,40 +907,11 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, XEvent event)
            the XFixesSetSelectionOwnerNotify event */
         handled = 1;
         break;
-    case SelectionRequest: {
-        struct vdagent_x11_selection_request *req, *new_req;
-
-        if (vdagent_x11_get_clipboard_selection(x11, &event, &selection)) {
-            return;
-        }
-
-        new_req = malloc(sizeof(*new_req));
-        if (!new_req) {
-            SELPRINTF("out of memory on SelectionRequest, ignoring.");
-            break;
-        }
-
+    case SelectionRequest:
+        vdagent_x11_handle_selection_request(x11, &event);
         handled = 1;
-
-        new_req->event = event;
-        new_req->selection = selection;
-        new_req->next = NULL;
-
-        if (!x11->selection_req) {
-            x11->selection_req = new_req;
-            vdagent_x11_handle_selection_request(x11);
-            break;
-        }
-
-        /* maybe we should limit the selection_request stack depth ? */
-        req = x11->selection_req;
-        while (req->next)
-            req = req->next;
-
-        req->next = new_req;
         break;
     }
-    }
     if (!handled && x11->debug)
         syslog(LOG_DEBUG, "unhandled x11 event, type %d, window %d",
                (int)event.type, (int)event.xany.window);
@@ -599,10 +929,50 @@ void vdagent_x11_do_read(struct vdagent_x11 *x11)
 
 static const char *vdagent_x11_get_atom_name(struct vdagent_x11 *x11, Atom a)
 {
+    const char *name;
+    char *xname;
+
     if (a == None)
         return "None";
 
-    return XGetAtomName(x11->display, a);
+    name = g_hash_table_lookup(x11->atom_names, GUINT_TO_POINTER(a));
+    if (name)
+        return name;
+
+    xname = XGetAtomName(x11->display, a);
+    if (!xname)
+        return "(invalid atom)";
+
+    name = g_strdup(xname);
+    XFree(xname);
+    g_hash_table_insert(x11->atom_names, GUINT_TO_POINTER(a), (char *)name);
+    return name;
+}
+
+/* Look up the names of all atoms in a list we do not know yet at once */
+static void vdagent_x11_get_atom_names(struct vdagent_x11 *x11,
+                                       Atom *atoms, int count)
+{
+    Atom unknown[256];
+    char *names[256];
+    int i, n = 0;
+
+    for (i = 0; i < count && n < 256; i++) {
+        if (atoms[i] != None &&
+                !g_hash_table_lookup(x11->atom_names,
+                                     GUINT_TO_POINTER(atoms[i])))
+            unknown[n++] = atoms[i];
+    }
+    if (n == 0)
+        return;
+
+    if (XGetAtomNames(x11->display, unknown, n, names)) {
+        for (i = 0; i < n; i++) {
+            g_hash_table_insert(x11->atom_names, GUINT_TO_POINTER(unknown[i]),
+                                g_strdup(names[i]));
+            XFree(names[i]);
+        }
+    }
 }
 
 static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
@@ -639,7 +1009,7 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
 
     if (!incr && prop != x11->targets_atom) {
         if (type_ret == x11->incr_atom) {
-            int prop_min_size = *(uint32_t*)data;
+            uint32_t prop_min_size = *(uint32_t*)data;
 
             if (x11->expect_property_notify) {
                 SELPRINTF("received an incr SelectionNotify while "
@@ -647,6 +1017,10 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
                 goto exit;
             }
 
+            /* The data gets streamed to vdagentd, so we never need room
+               for more than a chunk */
+            if (prop_min_size > CLIPBOARD_STREAM_CHUNK_SIZE)
+                prop_min_size = CLIPBOARD_STREAM_CHUNK_SIZE;
             if (x11->clipboard_data_space < prop_min_size) {
                 free(x11->clipboard_data);
                 x11->clipboard_data = malloc(prop_min_size);
@@ -693,10 +1067,27 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, XEvent *event,
 
     if (incr) {
         if (len) {
+            /* Pass on what we have so far before appending, so that the
+               final part sent on completion is never empty. Data which
+               gets converted can only be sent once complete. */
+            if (x11->clipboard_data_size >= CLIPBOARD_STREAM_CHUNK_SIZE &&
+                    x11->conversion_req->type ==
+                    vdagent_x11_target_to_type(x11, selection, type)) {
+                VSELPRINTF("Streaming %u bytes of clipboard data",
+                           x11->clipboard_data_size);
+                udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA_CHUNK,
+                            selection, x11->conversion_req->type,
+                            x11->clipboard_data, x11->clipboard_data_size);
+                x11->clipboard_data_size = 0;
+            }
             if (x11->clipboard_data_size + len > x11->clipboard_data_space) {
                 void *old_clipboard_data = x11->clipboard_data;
 
-                x11->clipboard_data_space = x11->clipboard_data_size + len;
+                /* Grow geometrically, the incr size hint is only a lower
+                   bound and some apps do not give one at all */
+                x11->clipboard_data_space *= 2;
+                if (x11->clipboard_data_space < x11->clipboard_data_size + len)
+                    x11->clipboard_data_space = x11->clipboard_data_size + len;
                 x11->clipboard_data = realloc(x11->clipboard_data,
                                               x11->clipboard_data_space);
                 if (!x11->clipboard_data) {
@@ -741,7 +1132,7 @@ static void vdagent_x11_get_selection_free(struct vdagent_x11 *x11,
 {
     if (incr) {
         /* If the clipboard has grown large return the memory to the system */
-        if (x11->clipboard_data_space > 512 * 1024) {
+        if (x11->clipboard_data_space > x11->clipboard_data_retain) {
             free(x11->clipboard_data);
             x11->clipboard_data = NULL;
             x11->clipboard_data_space = 0;
@@ -753,15 +1144,11 @@ static void vdagent_x11_get_selection_free(struct vdagent_x11 *x11,
 static uint32_t vdagent_x11_target_to_type(struct vdagent_x11 *x11,
     uint8_t selection, Atom target)
 {
-    int i, j;
+    gpointer value;
 
-    for (i = 0; i < clipboard_format_count; i++) {
-        for (j = 0; j < x11->clipboard_formats[i].atom_count; j++) {
-            if (x11->clipboard_formats[i].atoms[j] == target) {
-                return x11->clipboard_formats[i].type;
-            }
-        }
-    }
+    value = g_hash_table_lookup(x11->target_formats, GUINT_TO_POINTER(target));
+    if (value)
+        return x11->clipboard_formats[TARGET_FORMAT(value)].type;
 
     VSELPRINTF("unexpected selection type %s",
                vdagent_x11_get_atom_name(x11, target));
@@ -773,9 +1160,9 @@ static Atom vdagent_x11_type_to_target(struct vdagent_x11 *x11,
 {
     int i;
 
-    for (i = 0; i < x11->clipboard_type_count[selection]; i++) {
-        if (x11->clipboard_agent_types[selection][i] == type) {
-            return x11->clipboard_x11_targets[selection][i];
+    for (i = 0; i < x11->selections[selection].type_count; i++) {
+        if (x11->selections[selection].agent_types[i] == type) {
+            return x11->selections[selection].x11_targets[i];
         }
     }
     SELPRINTF("client requested unavailable type %u", type);
@@ -800,7 +1187,8 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
 {
     int len = 0;
     unsigned char *data = NULL;
-    uint32_t type;
+    uint8_t *converted = NULL;
+    uint32_t type, source, converted_size;
     uint8_t selection = -1;
     Atom clip = None;
 
@@ -833,9 +1221,10 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
     }
 
     selection = x11->conversion_req->selection;
-    type = vdagent_x11_target_to_type(x11, selection,
-                                      x11->conversion_req->target);
-    if (type == VD_AGENT_CLIPBOARD_NONE)
+    type = x11->conversion_req->type;
+    source = vdagent_x11_target_to_type(x11, selection,
+                                        x11->conversion_req->target);
+    if (source == VD_AGENT_CLIPBOARD_NONE)
         SELPRINTF("internal error conversion_req has bad target %s",
                   vdagent_x11_get_atom_name(x11, x11->conversion_req->target));
     if (len == 0) { /* No errors so far */
@@ -846,35 +1235,41 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
             return;
         }
     }
+    if (len != -1 && source != type) {
+        if (vdagent_image_convert(source, data, len, type,
+                                  &converted, &converted_size) == 0) {
+            VSELPRINTF("converted clipboard data from type %u to %u, "
+                       "%d -> %u bytes", source, type, len, converted_size);
+            len = converted_size;
+        } else {
+            SELPRINTF("failed to convert clipboard data from type %u to %u",
+                      source, type);
+            len = -1;
+        }
+    }
     if (len == -1) {
         type = VD_AGENT_CLIPBOARD_NONE;
         len = 0;
     }
 
     udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
-                data, len);
+                converted ? converted : data, len);
     vdagent_x11_get_selection_free(x11, data, incr);
+    free(converted);
 
     vdagent_x11_next_conversion_request(x11);
     vdagent_x11_handle_conversion_request(x11);
 }
 
-static Atom atom_lists_overlap(Atom *atoms1, Atom *atoms2, int l1, int l2)
-{
-    int i, j;
-
-    for (i = 0; i < l1; i++)
-        for (j = 0; j < l2; j++)
-            if (atoms1[i] == atoms2[j])
-                return atoms1[i];
-
-    return 0;
-}
-
 static void vdagent_x11_print_targets(struct vdagent_x11 *x11,
     uint8_t selection, const char *action, Atom *atoms, int c)
 {
     int i;
+
+    if (!x11->debug)
+        return;
+
+    vdagent_x11_get_atom_names(x11, atoms, c);
     VSELPRINTF("%s %d targets:", action, c);
     for (i = 0; i < c; i++)
         VSELPRINTF("%s", vdagent_x11_get_atom_name(x11, atoms[i]));
@@ -883,26 +1278,29 @@ static void vdagent_x11_print_targets(struct vdagent_x11 *x11,
 static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
                                               XEvent *event)
 {
-    int i, len;
-    Atom atom, *atoms = NULL;
+    int i, len, format, rank;
+    Atom *atoms = NULL;
+    Atom best_atom[clipboard_format_count];
+    int best_rank[clipboard_format_count];
+    gpointer value;
     uint8_t selection;
-    int *type_count;
+    struct vdagent_x11_selection *sel;
 
     if (vdagent_x11_get_clipboard_selection(x11, event, &selection)) {
         return;
     }
 
-    if (!x11->expected_targets_notifies[selection]) {
+    if (!x11->selections[selection].expected_targets_notifies) {
         SELPRINTF("unexpected selection notify TARGETS");
         return;
     }
 
-    x11->expected_targets_notifies[selection]--;
+    x11->selections[selection].expected_targets_notifies--;
 
     /* If we have more targets_notifies pending, ignore this one, we
        are only interested in the targets list of the current owner
        (which is the last one we've requested a targets list from) */
-    if (x11->expected_targets_notifies[selection]) {
+    if (x11->selections[selection].expected_targets_notifies) {
         return;
     }
 
@@ -916,28 +1314,42 @@ static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
     len /= sizeof(Atom);
     vdagent_x11_print_targets(x11, selection, "received", atoms, len);
 
-    type_count = &x11->clipboard_type_count[selection];
-    *type_count = 0;
+    /* For each format find the most preferred of its atoms on offer */
     for (i = 0; i < clipboard_format_count; i++) {
-        atom = atom_lists_overlap(x11->clipboard_formats[i].atoms, atoms,
-                                  x11->clipboard_formats[i].atom_count, len);
-        if (atom) {
-            x11->clipboard_agent_types[selection][*type_count] =
-                x11->clipboard_formats[i].type;
-            x11->clipboard_x11_targets[selection][*type_count] = atom;
-            (*type_count)++;
-            if (*type_count ==
-                    sizeof(x11->clipboard_agent_types[0])/sizeof(uint32_t)) {
-                SELPRINTF("handle_targets_notify: too many types");
-                break;
-            }
+        best_atom[i] = None;
+        best_rank[i] = INT_MAX;
+    }
+    for (i = 0; i < len; i++) {
+        value = g_hash_table_lookup(x11->target_formats,
+                                    GUINT_TO_POINTER(atoms[i]));
+        if (!value)
+            continue;
+        format = TARGET_FORMAT(value);
+        rank = TARGET_FORMAT_RANK(value);
+        if (rank < best_rank[format]) {
+            best_atom[format] = atoms[i];
+            best_rank[format] = rank;
         }
     }
 
-    if (*type_count) {
+    sel = &x11->selections[selection];
+    sel->type_count = 0;
+    for (i = 0; i < clipboard_format_count; i++) {
+        if (best_atom[i] != None) {
+            sel->agent_types[sel->type_count] = x11->clipboard_formats[i].type;
+            sel->source_types[sel->type_count] = x11->clipboard_formats[i].type;
+            sel->x11_targets[sel->type_count] = best_atom[i];
+            sel->type_count++;
+        }
+    }
+    /* Offer images as png too, so that clients which only take png can
+       paste them, and uncompressed images do not have to be sent as is */
+    vdagent_x11_selection_add_converted_type(sel, VD_AGENT_CLIPBOARD_IMAGE_PNG);
+
+    if (sel->type_count) {
         udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_GRAB, selection, 0,
-                    (uint8_t *)x11->clipboard_agent_types[selection],
-                    *type_count * sizeof(uint32_t));
+                    (uint8_t *)sel->agent_types,
+                    sel->type_count * sizeof(uint32_t));
         vdagent_x11_set_clipboard_owner(x11, selection, owner_guest);
     }
 
@@ -945,15 +1357,9 @@ static void vdagent_x11_handle_targets_notify(struct vdagent_x11 *x11,
 }
 
 static void vdagent_x11_send_selection_notify(struct vdagent_x11 *x11,
-    Atom prop, struct vdagent_x11_selection_request *request)
+                                              Atom prop, XEvent *event)
 {
-    XEvent res, *event;
-
-    if (request) {
-        event = &request->event;
-    } else {
-        event = &x11->selection_req->event;
-    }
+    XEvent res;
 
     res.xselection.property = prop;
     res.xselection.type = SelectionNotify;
@@ -966,11 +1372,6 @@ static void vdagent_x11_send_selection_notify(struct vdagent_x11 *x11,
     vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
     XSendEvent(x11->display, event->xselectionrequest.requestor, 0, 0, &res);
     vdagent_x11_restore_error_handler(x11);
-
-    if (!request) {
-        vdagent_x11_next_selection_request(x11);
-        vdagent_x11_handle_selection_request(x11);
-    }
 }
 
 static void vdagent_x11_send_targets(struct vdagent_x11 *x11,
@@ -979,19 +1380,17 @@ static void vdagent_x11_send_targets(struct vdagent_x11 *x11,
     Atom prop, targets[256] = { x11->targets_atom, };
     int i, j, k, target_count = 1;
 
-    for (i = 0; i < x11->clipboard_type_count[selection]; i++) {
-        for (j = 0; j < clipboard_format_count; j++) {
-            if (x11->clipboard_formats[j].type !=
-                    x11->clipboard_agent_types[selection][i])
-                continue;
-
-            for (k = 0; k < x11->clipboard_formats[j].atom_count; k++) {
-                targets[target_count] = x11->clipboard_formats[j].atoms[k];
-                target_count++;
-                if (target_count == sizeof(targets)/sizeof(Atom)) {
-                    SELPRINTF("send_targets: too many targets");
-                    goto exit_loop;
-                }
+    for (i = 0; i < x11->selections[selection].type_count; i++) {
+        j = vdagent_x11_type_to_format(x11->selections[selection].agent_types[i]);
+        if (j == -1)
+            continue;
+
+        for (k = 0; k < x11->clipboard_formats[j].atom_count; k++) {
+            targets[target_count] = x11->clipboard_formats[j].atoms[k];
+            target_count++;
+            if (target_count == sizeof(targets)/sizeof(Atom)) {
+                SELPRINTF("send_targets: too many targets");
+                goto exit_loop;
             }
         }
     }
@@ -1008,34 +1407,100 @@ exit_loop:
     if (vdagent_x11_restore_error_handler(x11) == 0) {
         vdagent_x11_print_targets(x11, selection, "sent",
                                   targets, target_count);
-        vdagent_x11_send_selection_notify(x11, prop, NULL);
+        vdagent_x11_send_selection_notify(x11, prop, event);
     } else
         SELPRINTF("send_targets: Failed to sent, requestor window gone");
 }
 
-static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11)
+/* Answer the selection request in event with the data in buf */
+static void vdagent_x11_send_clipboard_buffer(struct vdagent_x11 *x11,
+    uint8_t selection, XEvent *event, struct vdagent_x11_clipboard_buffer *buf)
 {
-    XEvent *event;
-    uint32_t type = VD_AGENT_CLIPBOARD_NONE;
+    struct vdagent_x11_incr_send *incr;
+    Window requestor = event->xselectionrequest.requestor;
+    Atom prop;
+
+    prop = event->xselectionrequest.property;
+    if (prop == None)
+        prop = event->xselectionrequest.target;
+
+    /* Data which is still coming in always goes through incr, the size we
+       announce then is a lower bound, as allowed by the ICCCM */
+    if (buf->size > x11->max_prop_size || !buf->complete) {
+        unsigned long len = buf->size;
+        guint64 key = INCR_SEND_KEY(requestor, prop);
+
+        if (g_hash_table_lookup(x11->incr_sends, &key)) {
+            SELPRINTF("incr send to the same property already in progress");
+            vdagent_x11_send_selection_notify(x11, None, event);
+            return;
+        }
+
+        incr = malloc(sizeof(*incr));
+        if (!incr) {
+            SELPRINTF("out of memory allocating incr send");
+            vdagent_x11_send_selection_notify(x11, None, event);
+            return;
+        }
+
+        VSELPRINTF("Starting incr send of clipboard data");
+        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+        XSelectInput(x11->display, requestor, PropertyChangeMask);
+        XChangeProperty(x11->display, requestor, prop,
+                        x11->incr_atom, 32, PropModeReplace,
+                        (unsigned char*)&len, 1);
+        if (vdagent_x11_restore_error_handler(x11) == 0) {
+            incr->key = key;
+            incr->requestor = requestor;
+            incr->property = prop;
+            incr->target = event->xselectionrequest.target;
+            incr->selection = selection;
+            incr->data = buf;
+            incr->pos = 0;
+            incr->waiting = 0;
+            incr->aborted = 0;
+            buf->ref++;
+            g_hash_table_insert(x11->incr_sends, &incr->key, incr);
+            vdagent_x11_send_selection_notify(x11, prop, event);
+        } else {
+            SELPRINTF("clipboard data sent failed, requestor window gone");
+            free(incr);
+        }
+    } else {
+        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
+        XChangeProperty(x11->display, requestor, prop,
+                        event->xselectionrequest.target, 8, PropModeReplace,
+                        buf->data, buf->size);
+        if (vdagent_x11_restore_error_handler(x11) == 0)
+            vdagent_x11_send_selection_notify(x11, prop, event);
+        else
+            SELPRINTF("clipboard data sent failed, requestor window gone");
+    }
+}
+
+static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11,
+                                                 XEvent *event)
+{
+    struct vdagent_x11_selection_request *req, *new_req;
+    struct vdagent_x11_clipboard_buffer *buf;
+    uint32_t type = VD_AGENT_CLIPBOARD_NONE, source;
     uint8_t selection;
+    int i;
 
-    if (!x11->selection_req)
+    if (vdagent_x11_get_clipboard_selection(x11, event, &selection))
         return;
 
-    event = &x11->selection_req->event;
-    selection = x11->selection_req->selection;
-
-    if (x11->clipboard_owner[selection] != owner_client) {
+    if (x11->selections[selection].owner != owner_client) {
         SELPRINTF("received selection request event for target %s, "
                   "while not owning client clipboard",
             vdagent_x11_get_atom_name(x11, event->xselectionrequest.target));
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+        vdagent_x11_send_selection_notify(x11, None, event);
         return;
     }
 
     if (event->xselectionrequest.target == x11->multiple_atom) {
         SELPRINTF("multiple target not supported");
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+        vdagent_x11_send_selection_notify(x11, None, event);
         return;
     }
 
@@ -1048,7 +1513,7 @@ static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11)
                         event->xselectionrequest.target, 32, PropModeReplace,
                         (guint8*)&timestamp, 1);
         vdagent_x11_send_selection_notify(x11,
-                       event->xselectionrequest.property, NULL);
+                       event->xselectionrequest.property, event);
        return;
     }
 
@@ -1062,74 +1527,135 @@ static void vdagent_x11_handle_selection_request(struct vdagent_x11 *x11)
                                       event->xselectionrequest.target);
     if (type == VD_AGENT_CLIPBOARD_NONE) {
         VSELPRINTF("guest app requested a non-advertised target");
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+        vdagent_x11_send_selection_notify(x11, None, event);
+        return;
+    }
+
+    buf = vdagent_x11_clipboard_cache_lookup(x11, selection, type);
+    if (buf) {
+        VSELPRINTF("answering request for type %u from cache", type);
+        vdagent_x11_send_clipboard_buffer(x11, selection, event, buf);
+        return;
+    }
+
+    i = vdagent_x11_selection_find_type(&x11->selections[selection], type);
+    source = i == -1 ? type : x11->selections[selection].source_types[i];
+    if (source != type) {
+        buf = vdagent_x11_clipboard_cache_lookup(x11, selection, source);
+        if (buf) {
+            VSELPRINTF("answering request for type %u from cached type %u",
+                       type, source);
+            buf = vdagent_x11_clipboard_buffer_convert(x11, selection,
+                                                       buf, type);
+            if (buf) {
+                vdagent_x11_send_clipboard_buffer(x11, selection, event, buf);
+                vdagent_x11_clipboard_buffer_unref(buf);
+            } else
+                vdagent_x11_send_selection_notify(x11, None, event);
+            return;
+        }
+    }
+
+    buf = x11->client_stream;
+    if (buf && x11->client_stream_selection == selection &&
+            buf->type == type) {
+        VSELPRINTF("answering request for type %u from incoming data", type);
+        vdagent_x11_send_clipboard_buffer(x11, selection, event, buf);
+        return;
+    }
+
+    new_req = malloc(sizeof(*new_req));
+    if (!new_req) {
+        SELPRINTF("out of memory on SelectionRequest, ignoring.");
+        vdagent_x11_send_selection_notify(x11, None, event);
         return;
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_REQUEST, selection, type,
-                NULL, 0);
+    new_req->event = *event;
+    new_req->selection = selection;
+    new_req->type = type;
+    new_req->source = source;
+    new_req->next = NULL;
+
+    /* Only ask the client for data if no other request is already
+       waiting for the same selection and type, and the data is not
+       already coming in */
+    for (req = x11->selection_req; req; req = req->next)
+        if (req->selection == selection && req->source == source)
+            break;
+    buf = x11->client_stream;
+    if (!req && !(buf && x11->client_stream_selection == selection &&
+                  buf->type == source))
+        udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_REQUEST, selection,
+                    source, NULL, 0);
+
+    if (x11->selection_req_tail)
+        x11->selection_req_tail->next = new_req;
+    else
+        x11->selection_req = new_req;
+    x11->selection_req_tail = new_req;
 }
 
-static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
-                                                      XEvent *del_event)
+/* Send the next part of the data for an incr send, returns 1 when the incr
+   send is done */
+static int vdagent_x11_incr_send_next(struct vdagent_x11 *x11,
+                                      struct vdagent_x11_incr_send *incr)
 {
-    XEvent *sel_event;
+    uint8_t selection = incr->selection;
     int len;
-    uint8_t selection;
 
-    assert(x11->selection_req);
-    sel_event = &x11->selection_req->event;
-    selection = x11->selection_req->selection;
-    if (del_event->xproperty.window != sel_event->xselectionrequest.requestor
-            || del_event->xproperty.atom != x11->selection_req_atom) {
-        return;
+    len = incr->aborted ? 0 : incr->data->size - incr->pos;
+    if (len == 0 && !incr->data->complete && !incr->aborted) {
+        /* Continue when more data has come in from the client */
+        incr->waiting = 1;
+        return 0;
     }
+    incr->waiting = 0;
 
-    len = x11->selection_req_data_size - x11->selection_req_data_pos;
     if (len > x11->max_prop_size) {
         len = x11->max_prop_size;
     }
 
     if (len) {
         VSELPRINTF("Sending %d-%d/%d bytes of clipboard data",
-                x11->selection_req_data_pos,
-                x11->selection_req_data_pos + len - 1,
-                x11->selection_req_data_size);
+                incr->pos, incr->pos + len - 1, incr->data->size);
     } else {
         VSELPRINTF("Ending incr send of clipboard data");
     }
     vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-    XChangeProperty(x11->display, sel_event->xselectionrequest.requestor,
-                    x11->selection_req_atom,
-                    sel_event->xselectionrequest.target, 8, PropModeReplace,
-                    x11->selection_req_data + x11->selection_req_data_pos,
-                    len);
+    XChangeProperty(x11->display, incr->requestor, incr->property,
+                    incr->target, 8, PropModeReplace,
+                    incr->data->data + incr->pos, len);
     if (vdagent_x11_restore_error_handler(x11)) {
         SELPRINTF("incr sent failed, requestor window gone");
         len = 0;
     }
 
-    x11->selection_req_data_pos += len;
+    incr->pos += len;
 
     /* Note we must explictly send a 0 sized XChangeProperty to signal the
        incr transfer is done. Hence we do not check if we've send all data
        but instead check we've send the final 0 sized XChangeProperty. */
-    if (len == 0) {
-        free(x11->selection_req_data);
-        x11->selection_req_data = NULL;
-        x11->selection_req_data_pos = 0;
-        x11->selection_req_data_size = 0;
-        x11->selection_req_atom = None;
-        vdagent_x11_next_selection_request(x11);
-        vdagent_x11_handle_selection_request(x11);
-    }
+    return len == 0;
+}
+
+static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
+                                                      XEvent *del_event)
+{
+    struct vdagent_x11_incr_send *incr;
+    guint64 key;
+
+    key = INCR_SEND_KEY(del_event->xproperty.window, del_event->xproperty.atom);
+    incr = g_hash_table_lookup(x11->incr_sends, &key);
+    if (incr && vdagent_x11_incr_send_next(x11, incr))
+        g_hash_table_remove(x11->incr_sends, &key);
 }
 
 void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
         uint8_t selection, uint32_t type)
 {
     Atom target, clip;
-    struct vdagent_x11_conversion_request *req, *new_req;
+    struct vdagent_x11_conversion_request *new_req;
 
     /* We don't use clip here, but we call get_clipboard_atom to verify
        selection is valid */
@@ -1137,7 +1663,7 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
         goto none;
     }
 
-    if (x11->clipboard_owner[selection] != owner_guest) {
+    if (x11->selections[selection].owner != owner_guest) {
         SELPRINTF("received clipboard req while not owning guest clipboard");
         goto none;
     }
@@ -1155,10 +1681,12 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
 
     new_req->target = target;
     new_req->selection = selection;
+    new_req->type = type;
     new_req->next = NULL;
 
     if (!x11->conversion_req) {
         x11->conversion_req = new_req;
+        x11->conversion_req_tail = new_req;
         vdagent_x11_handle_conversion_request(x11);
         /* Flush output buffers and consume any pending events */
         vdagent_x11_do_read(x11);
@@ -1166,11 +1694,8 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
     }
 
     /* maybe we should limit the conversion_request stack depth ? */
-    req = x11->conversion_req;
-    while (req->next)
-        req = req->next;
-
-    req->next = new_req;
+    x11->conversion_req_tail->next = new_req;
+    x11->conversion_req_tail = new_req;
     return;
 
 none:
@@ -1181,20 +1706,39 @@ none:
 void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t *types, uint32_t type_count)
 {
+    struct vdagent_x11_selection *sel;
     Atom clip = None;
+    uint32_t i;
+    int j;
 
     if (vdagent_x11_get_clipboard_atom(x11, selection, &clip)) {
         return;
     }
 
-    if (type_count > sizeof(x11->clipboard_agent_types[0])/sizeof(uint32_t)) {
-        SELPRINTF("x11_clipboard_grab: too many types");
-        type_count = sizeof(x11->clipboard_agent_types[0])/sizeof(uint32_t);
+    /* Only keep the types we know, once each, others are of no use to
+       guest apps anyways */
+    sel = &x11->selections[selection];
+    sel->type_count = 0;
+    for (i = 0; i < type_count; i++) {
+        if (vdagent_x11_type_to_format(types[i]) == -1) {
+            VSELPRINTF("x11_clipboard_grab: ignoring unknown type %u",
+                       types[i]);
+            continue;
+        }
+        for (j = 0; j < sel->type_count; j++)
+            if (sel->agent_types[j] == types[i])
+                break;
+        if (j == sel->type_count) {
+            sel->agent_types[sel->type_count] = types[i];
+            sel->source_types[sel->type_count] = types[i];
+            sel->type_count++;
+        }
     }
-
-    memcpy(x11->clipboard_agent_types[selection], types,
-           type_count * sizeof(uint32_t));
-    x11->clipboard_type_count[selection] = type_count;
+    /* Also offer images in the formats we can convert them to, for guest
+       apps which do not take the format the client has */
+    for (i = 0; i < image_type_count; i++)
+        vdagent_x11_selection_add_converted_type(sel,
+                                                 vdagent_x11_image_types[i]);
 
     XSetSelectionOwner(x11->display, clip,
                        x11->selection_window, CurrentTime);
@@ -1207,20 +1751,63 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
 void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t type, uint8_t *data, uint32_t size)
 {
-    Atom prop;
-    XEvent *event;
-    uint32_t type_from_event;
+    struct vdagent_x11_selection_request *req;
+    struct vdagent_x11_clipboard_buffer *buf;
+    uint32_t stream_type;
+    Atom clip;
 
-    if (x11->selection_req_data) {
-        if (type || size) {
-            SELPRINTF("received clipboard data while still sending"
-                      " data from previous request, ignoring");
-        }
+    if (vdagent_x11_get_clipboard_atom(x11, selection, &clip)) {
         free(data);
         return;
     }
 
-    if (!x11->selection_req) {
+    if (x11->client_stream_dropped &&
+            x11->client_stream_selection == selection) {
+        /* The final part of data we could not take in, refuse the requests
+           which were waiting for it */
+        x11->client_stream_dropped = 0;
+        free(data);
+        vdagent_x11_answer_selection_requests(x11, selection, type, NULL);
+        vdagent_x11_do_read(x11);
+        return;
+    }
+
+    buf = x11->client_stream;
+    if (buf && x11->client_stream_selection == selection) {
+        if (buf->type == type &&
+                vdagent_x11_clipboard_buffer_append(buf, data, size) == 0) {
+            free(data);
+            buf->complete = 1;
+            x11->client_stream = NULL;
+            vdagent_x11_clipboard_cache_store(x11, selection, buf);
+            vdagent_x11_answer_selection_requests(x11, selection, type, buf);
+            vdagent_x11_incr_sends_wakeup(x11, buf);
+            vdagent_x11_clipboard_buffer_unref(buf);
+
+            /* Flush output buffers and consume any pending events */
+            vdagent_x11_do_read(x11);
+            return;
+        }
+        stream_type = buf->type;
+        vdagent_x11_client_stream_abort(x11);
+        if (type == VD_AGENT_CLIPBOARD_NONE) {
+            /* The client gave up on sending the rest, refuse the requests
+               which were waiting for all of it to convert it */
+            free(data);
+            vdagent_x11_answer_selection_requests(x11, selection,
+                                                  stream_type, NULL);
+            vdagent_x11_do_read(x11);
+            return;
+        }
+        SELPRINTF("failed to complete incoming clipboard data");
+    }
+
+    for (req = x11->selection_req; req; req = req->next)
+        if (req->selection == selection &&
+                (type == VD_AGENT_CLIPBOARD_NONE || req->source == type))
+            break;
+
+    if (!req) {
         if (type || size) {
             SELPRINTF("received clipboard data without an "
                       "outstanding selection request, ignoring");
@@ -1229,21 +1816,12 @@ void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
         return;
     }
 
-    event = &x11->selection_req->event;
-    type_from_event = vdagent_x11_target_to_type(x11,
-                                             x11->selection_req->selection,
-                                             event->xselectionrequest.target);
-    if (type_from_event != type ||
-            selection != x11->selection_req->selection) {
-        if (selection != x11->selection_req->selection) {
-            SELPRINTF("expecting data for selection %d got %d",
-                      (int)x11->selection_req->selection, (int)selection);
-        }
-        if (type_from_event != type) {
-            SELPRINTF("expecting type %u clipboard data got %u",
-                      type_from_event, type);
-        }
-        vdagent_x11_send_selection_notify(x11, None, NULL);
+    if (type == VD_AGENT_CLIPBOARD_NONE) {
+        /* The client could not give us the data, it does not tell us for
+           which type, so this answers our oldest request for selection */
+        VSELPRINTF("client has no data for type %u", req->source);
+        vdagent_x11_answer_selection_requests(x11, selection, req->source,
+                                              NULL);
         free(data);
 
         /* Flush output buffers and consume any pending events */
@@ -1251,41 +1829,71 @@ void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
         return;
     }
 
-    prop = event->xselectionrequest.property;
-    if (prop == None)
-        prop = event->xselectionrequest.target;
+    buf = vdagent_x11_clipboard_buffer_new(type, data, size);
+    if (!buf) {
+        SELPRINTF("out of memory allocating clipboard buffer");
+        vdagent_x11_answer_selection_requests(x11, selection, type, NULL);
+    } else {
+        vdagent_x11_clipboard_cache_store(x11, selection, buf);
+        vdagent_x11_answer_selection_requests(x11, selection, type, buf);
+        vdagent_x11_clipboard_buffer_unref(buf);
+    }
 
-    if (size > x11->max_prop_size) {
-        unsigned long len = size;
-        VSELPRINTF("Starting incr send of clipboard data");
+    /* Flush output buffers and consume any pending events */
+    vdagent_x11_do_read(x11);
+}
 
-        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-        XSelectInput(x11->display, event->xselectionrequest.requestor,
-                     PropertyChangeMask);
-        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
-                        x11->incr_atom, 32, PropModeReplace,
-                        (unsigned char*)&len, 1);
-        if (vdagent_x11_restore_error_handler(x11) == 0) {
-            x11->selection_req_data = data;
-            x11->selection_req_data_pos = 0;
-            x11->selection_req_data_size = size;
-            x11->selection_req_atom = prop;
-            vdagent_x11_send_selection_notify(x11, prop, x11->selection_req);
-        } else {
-            SELPRINTF("clipboard data sent failed, requestor window gone");
+void vdagent_x11_clipboard_data_chunk(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, uint8_t *data, uint32_t size)
+{
+    struct vdagent_x11_clipboard_buffer *buf;
+    Atom clip;
+
+    if (vdagent_x11_get_clipboard_atom(x11, selection, &clip)) {
+        free(data);
+        return;
+    }
+
+    if (x11->client_stream_dropped) {
+        if (x11->client_stream_selection == selection) {
             free(data);
+            return;
         }
-    } else {
-        vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
-        XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
-                        event->xselectionrequest.target, 8, PropModeReplace,
-                        data, size);
-        if (vdagent_x11_restore_error_handler(x11) == 0)
-            vdagent_x11_send_selection_notify(x11, prop, NULL);
-        else
-            SELPRINTF("clipboard data sent failed, requestor window gone");
+        x11->client_stream_dropped = 0;
+    }
+
+    buf = x11->client_stream;
+    if (buf && (x11->client_stream_selection != selection ||
+                buf->type != type)) {
+        SELPRINTF("clipboard data chunk for another selection or type, "
+                  "dropping earlier data");
+        vdagent_x11_client_stream_abort(x11);
+        buf = NULL;
+    }
 
+    if (buf) {
+        if (vdagent_x11_clipboard_buffer_append(buf, data, size)) {
+            SELPRINTF("out of memory appending clipboard data");
+            vdagent_x11_client_stream_abort(x11);
+            x11->client_stream_dropped = 1;
+        } else {
+            vdagent_x11_incr_sends_wakeup(x11, buf);
+        }
         free(data);
+    } else {
+        /* The first part of the data, start answering the requests waiting
+           for it right away, the rest follows as it comes in */
+        buf = vdagent_x11_clipboard_buffer_new(type, data, size);
+        if (!buf) {
+            SELPRINTF("out of memory allocating clipboard buffer");
+            x11->client_stream_selection = selection;
+            x11->client_stream_dropped = 1;
+            return;
+        }
+        buf->complete = 0;
+        x11->client_stream = buf;
+        x11->client_stream_selection = selection;
+        vdagent_x11_answer_selection_requests(x11, selection, type, buf);
     }
 
     /* Flush output buffers and consume any pending events */
@@ -1301,7 +1909,7 @@ void vdagent_x11_clipboard_release(struct vdagent_x11 *x11, uint8_t selection)
         return;
     }
 
-    if (x11->clipboard_owner[selection] != owner_client) {
+    if (x11->selections[selection].owner != owner_client) {
         VSELPRINTF("received release while not owning client clipboard");
         return;
     }
@@ -1326,8 +1934,8 @@ void vdagent_x11_client_disconnected(struct vdagent_x11 *x11)
 {
     int sel;
 
-    for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
-        if (x11->clipboard_owner[sel] == owner_client)
+    for (sel = 0; sel < SELECTION_COUNT; sel++) {
+        if (x11->selections[sel].owner == owner_client)
             vdagent_x11_clipboard_release(x11, sel);
     }
 }
@@ -28,8 +28,12 @@
 
 struct vdagent_x11;
 
+/* Default amount of guest clipboard receive buffer space, in bytes, which is
+   kept around between transfers rather than returned to the system */
+#define CLIPBOARD_DATA_RETAIN_DEFAULT (512 * 1024)
+
 struct vdagent_x11 *vdagent_x11_create(struct udscs_connection *vdagentd,
-    int debug, int sync);
+    int debug, int sync, uint32_t clipboard_retain);
 void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected);
 
 int  vdagent_x11_get_fd(struct vdagent_x11 *x11);
@@ -44,6 +48,8 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
     uint8_t selection, uint32_t type);
 void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
     uint32_t type, uint8_t *data, uint32_t size);
+void vdagent_x11_clipboard_data_chunk(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, uint8_t *data, uint32_t size);
 void vdagent_x11_clipboard_release(struct vdagent_x11 *x11, uint8_t selection);
 
 void vdagent_x11_client_disconnected(struct vdagent_x11 *x11);
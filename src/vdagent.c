@@ -49,19 +49,57 @@ static const char *vdagentd_socket = VDAGENTD_SOCKET;
 static int debug = 0;
 static const char *fx_dir = NULL;
 static int fx_open_dir = -1;
+static const char *fx_send_dir = NULL;
+static int clipboard_retain = CLIPBOARD_DATA_RETAIN_DEFAULT / 1024;
 static struct vdagent_x11 *x11 = NULL;
 static struct vdagent_file_xfers *vdagent_file_xfers = NULL;
 static struct udscs_connection *client = NULL;
 static int quit = 0;
 static int version_mismatch = 0;
 
+/* While the client window is being resized, the client sends a stream of
+   monitor configs. Each one replaces the pending one, which gets applied
+   once none came in for MONITORS_CONFIG_DELAY, but no later than
+   MONITORS_CONFIG_MAX_DELAY after the first, so that only the final size
+   goes through RandR and not every step of the resize. */
+#define MONITORS_CONFIG_DELAY     (150 * 1000)
+#define MONITORS_CONFIG_MAX_DELAY (1000 * 1000)
+
+static VDAgentMonitorsConfig *pending_mon_config = NULL;
+/* Monotonic times at which to apply pending_mon_config */
+static gint64 mon_config_time = 0;
+static gint64 mon_config_deadline = 0;
+
+static void apply_monitors_config(void)
+{
+    VDAgentMonitorsConfig *mon_config = pending_mon_config;
+
+    pending_mon_config = NULL;
+    mon_config_time = 0;
+    mon_config_deadline = 0;
+    if (mon_config) {
+        vdagent_x11_set_monitor_config(x11, mon_config, 0);
+        free(mon_config);
+    }
+}
+
+static void queue_monitors_config(VDAgentMonitorsConfig *mon_config)
+{
+    gint64 now = g_get_monotonic_time();
+
+    free(pending_mon_config);
+    pending_mon_config = mon_config;
+    if (!mon_config_deadline)
+        mon_config_deadline = now + MONITORS_CONFIG_MAX_DELAY;
+    mon_config_time = MIN(now + MONITORS_CONFIG_DELAY, mon_config_deadline);
+}
+
 static void daemon_read_complete(struct udscs_connection **connp,
     struct udscs_message_header *header, uint8_t *data)
 {
     switch (header->type) {
     case VDAGENTD_MONITORS_CONFIG:
-        vdagent_x11_set_monitor_config(x11, (VDAgentMonitorsConfig *)data, 0);
-        free(data);
+        queue_monitors_config((VDAgentMonitorsConfig *)data);
         break;
     case VDAGENTD_CLIPBOARD_REQUEST:
         vdagent_x11_clipboard_request(x11, header->arg1, header->arg2);
@@ -78,6 +116,12 @@ static void daemon_read_complete(struct udscs_connection **connp,
         /* vdagent_x11_clipboard_data takes ownership of the data (or frees
            it immediately) */
         break;
+    case VDAGENTD_CLIPBOARD_DATA_CHUNK:
+        vdagent_x11_clipboard_data_chunk(x11, header->arg1, header->arg2,
+                                         data, header->size);
+        /* vdagent_x11_clipboard_data_chunk takes ownership of the data (or
+           frees it immediately) */
+        break;
     case VDAGENTD_CLIPBOARD_RELEASE:
         vdagent_x11_clipboard_release(x11, header->arg1);
         free(data);
@@ -95,7 +139,7 @@ static void daemon_read_complete(struct udscs_connection **connp,
             vdagent_file_xfers_start(vdagent_file_xfers,
                                      (VDAgentFileXferStartMessage *)data);
         } else {
-            vdagent_file_xfers_error(*connp,
+            vdagent_file_xfers_error(vdagent_file_xfers, *connp,
                                      ((VDAgentFileXferStartMessage *)data)->id);
         }
         free(data);
@@ -105,7 +149,7 @@ static void daemon_read_complete(struct udscs_connection **connp,
             vdagent_file_xfers_status(vdagent_file_xfers,
                                       (VDAgentFileXferStatusMessage *)data);
         } else {
-            vdagent_file_xfers_error(*connp,
+            vdagent_file_xfers_error(vdagent_file_xfers, *connp,
                                      ((VDAgentFileXferStatusMessage *)data)->id);
         }
         free(data);
@@ -115,7 +159,7 @@ static void daemon_read_complete(struct udscs_connection **connp,
             syslog(LOG_DEBUG, "Disabling file-xfers");
 
         if (vdagent_file_xfers != NULL) {
-            vdagent_file_xfers_destroy(vdagent_file_xfers);
+            vdagent_file_xfers_destroy(vdagent_file_xfers, 0);
             vdagent_file_xfers = NULL;
         }
         break;
@@ -134,17 +178,23 @@ static void daemon_read_complete(struct udscs_connection **connp,
             vdagent_file_xfers_data(vdagent_file_xfers,
                                     (VDAgentFileXferDataMessage *)data);
         } else {
-            vdagent_file_xfers_error(*connp,
+            vdagent_file_xfers_error(vdagent_file_xfers, *connp,
                                      ((VDAgentFileXferDataMessage *)data)->id);
         }
         free(data);
         break;
+    case VDAGENTD_FILE_XFER_DATA_ACK:
+        if (vdagent_file_xfers != NULL)
+            vdagent_file_xfers_data_ack(vdagent_file_xfers, header->arg1);
+        free(data);
+        break;
     case VDAGENTD_CLIENT_DISCONNECTED:
         vdagent_x11_client_disconnected(x11);
         if (vdagent_file_xfers != NULL) {
-            vdagent_file_xfers_destroy(vdagent_file_xfers);
+            vdagent_file_xfers_destroy(vdagent_file_xfers, 0);
             vdagent_file_xfers = vdagent_file_xfers_create(client, fx_dir,
-                                                           fx_open_dir, debug);
+                                                           fx_open_dir,
+                                                           fx_send_dir, debug);
         }
         break;
     default:
@@ -180,8 +230,11 @@ static void usage(FILE *fp)
       "  -S <filename>                     set udcs socket\n"
       "  -x                                don't daemonize\n"
       "  -f <dir|xdg-desktop|xdg-download> file xfer save dir\n"
-      "  -o <0|1>                          open dir on file xfer completion\n",
-      VERSION);
+      "  -o <0|1>                          open dir on file xfer completion\n"
+      "  -F <dir>                          send files written to dir to the client\n"
+      "  -b <KiB>                          clipboard receive buffer to keep\n"
+      "                                    between transfers (default %d)\n",
+      VERSION, CLIPBOARD_DATA_RETAIN_DEFAULT / 1024);
 }
 
 static void quit_handler(int sig)
@@ -247,14 +300,16 @@ static int file_test(const char *path)
 int main(int argc, char *argv[])
 {
     fd_set readfds, writefds;
-    int c, n, nfds, x11_fd;
+    int c, n, nfds, x11_fd, fx_fd;
     int do_daemonize = 1;
     int parent_socket = 0;
     int x11_sync = 0;
     struct sigaction act;
+    struct timeval timeout, *timeout_p;
+    gint64 now, wakeup, fx_timeout;
 
     for (;;) {
-        if (-1 == (c = getopt(argc, argv, "-dxhys:f:o:S:")))
+        if (-1 == (c = getopt(argc, argv, "-dxhys:f:o:F:S:b:")))
             break;
         switch (c) {
         case 'd':
@@ -278,9 +333,19 @@ int main(int argc, char *argv[])
         case 'o':
             fx_open_dir = atoi(optarg);
             break;
+        case 'F':
+            fx_send_dir = optarg;
+            break;
         case 'S':
             vdagentd_socket = optarg;
             break;
+        case 'b':
+            clipboard_retain = atoi(optarg);
+            if (clipboard_retain < 0 || clipboard_retain > 1024 * 1024) {
+                fprintf(stderr, "invalid clipboard buffer size: %s\n", optarg);
+                return 1;
+            }
+            break;
         default:
             fputs("\n", stderr);
             usage(stderr);
@@ -318,7 +383,8 @@ reconnect:
         return 1;
     }
 
-    x11 = vdagent_x11_create(client, debug, x11_sync);
+    x11 = vdagent_x11_create(client, debug, x11_sync,
+                             clipboard_retain * 1024);
     if (!x11) {
         udscs_destroy_connection(&client);
         return 1;
@@ -338,7 +404,8 @@ reconnect:
         fx_dir = g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD);
     if (fx_dir) {
         vdagent_file_xfers = vdagent_file_xfers_create(client, fx_dir,
-                                                       fx_open_dir, debug);
+                                                       fx_open_dir,
+                                                       fx_send_dir, debug);
     } else {
         syslog(LOG_WARNING,
                "warning could not get file xfer save dir, file transfers will be disabled");
@@ -361,8 +428,36 @@ reconnect:
         FD_SET(x11_fd, &readfds);
         if (x11_fd >= nfds)
             nfds = x11_fd + 1;
+        fx_fd = -1;
+        if (vdagent_file_xfers != NULL)
+            fx_fd = vdagent_file_xfers_get_fd(vdagent_file_xfers);
+        if (fx_fd != -1) {
+            FD_SET(fx_fd, &readfds);
+            if (fx_fd >= nfds)
+                nfds = fx_fd + 1;
+        }
 
-        n = select(nfds, &readfds, &writefds, NULL, NULL);
+        timeout_p = NULL;
+        wakeup = mon_config_time;
+        if (vdagent_file_xfers != NULL) {
+            fx_timeout = vdagent_file_xfers_get_timeout(vdagent_file_xfers);
+            if (fx_timeout && (!wakeup || fx_timeout < wakeup))
+                wakeup = fx_timeout;
+        }
+        if (wakeup) {
+            now = g_get_monotonic_time();
+            if (mon_config_time && now >= mon_config_time) {
+                apply_monitors_config();
+                continue;
+            }
+            /* An expired file-xfer timeout is handled by the flush below */
+            wakeup = MAX(wakeup - now, 0);
+            timeout.tv_sec = wakeup / G_USEC_PER_SEC;
+            timeout.tv_usec = wakeup % G_USEC_PER_SEC;
+            timeout_p = &timeout;
+        }
+
+        n = select(nfds, &readfds, &writefds, NULL, timeout_p);
         if (n == -1) {
             if (errno == EINTR)
                 continue;
@@ -372,11 +467,22 @@ reconnect:
 
         if (FD_ISSET(x11_fd, &readfds))
             vdagent_x11_do_read(x11);
+        if (fx_fd != -1 && FD_ISSET(fx_fd, &readfds))
+            vdagent_file_xfers_handle_fd(vdagent_file_xfers);
         udscs_client_handle_fds(&client, &readfds, &writefds);
+        if (client && vdagent_file_xfers != NULL)
+            vdagent_file_xfers_flush(vdagent_file_xfers);
     }
 
+    /* A pending config is for this X connection, the daemon sends the
+       current one again when we reconnect */
+    free(pending_mon_config);
+    pending_mon_config = NULL;
+    mon_config_time = 0;
+    mon_config_deadline = 0;
+
     if (vdagent_file_xfers != NULL) {
-        vdagent_file_xfers_destroy(vdagent_file_xfers);
+        vdagent_file_xfers_destroy(vdagent_file_xfers, client == NULL);
     }
     vdagent_x11_destroy(x11, client == NULL);
     udscs_destroy_connection(&client);
@@ -36,6 +36,8 @@ static const char * const vdagentd_messages[] = {
         "file xfer data",
         "file xfer disable",
         "client disconnected",
+        "file xfer data ack",
+        "clipboard data chunk",
 };
 
 #endif
@@ -38,13 +38,29 @@ enum {
     VDAGENTD_VERSION,           /* daemon -> client, data: version string */
     VDAGENTD_AUDIO_VOLUME_SYNC,
     VDAGENTD_FILE_XFER_START,
-    VDAGENTD_FILE_XFER_STATUS,
+    VDAGENTD_FILE_XFER_STATUS,  /* client -> daemon: arg1: id, arg2: result,
+                                   or when there is data: an array of
+                                   VDAgentFileXferStatusMessage-s
+                                   daemon -> client: data:
+                                   VDAgentFileXferStatusMessage */
     VDAGENTD_FILE_XFER_DATA,
     VDAGENTD_FILE_XFER_DISABLE,
     VDAGENTD_CLIENT_DISCONNECTED,  /* daemon -> client */
+    VDAGENTD_FILE_XFER_DATA_ACK, /* daemon -> client, arg1: number of guest
+                                    originated file xfer data messages which
+                                    have been passed on to the spice client */
+    VDAGENTD_CLIPBOARD_DATA_CHUNK, /* arg1: sel, arg2: type,
+                                      data: part of the clipboard data, the
+                                      rest follows in more chunks and the
+                                      final part in a VDAGENTD_CLIPBOARD_DATA
+                                      for the same sel and type */
     VDAGENTD_NO_MESSAGES /* Must always be last */
 };
 
+/* File xfers started by the guest (rather then by the client) use ids with
+   this bit set, so that they can not clash with client chosen ids */
+#define VDAGENTD_FILE_XFER_GUEST_ID 0x80000000
+
 struct vdagentd_guest_xorg_resolution {
     int width;
     int height;
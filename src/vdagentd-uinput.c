@@ -24,6 +24,7 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -33,6 +34,12 @@
 #include <spice/vd_agent.h>
 #include "vdagentd-uinput.h"
 
+/* Coordinate range of the tablet when it has a fixed range */
+#define UINPUT_FIXED_RANGE_MAX 32767
+
+/* REL_WHEEL_HI_RES is in 1/120ths of a wheel notch */
+#define WHEEL_HI_RES_PER_NOTCH 120
+
 struct vdagentd_uinput {
     const char *devname;
     int fd;
@@ -43,12 +50,17 @@ struct vdagentd_uinput {
     int screen_count;
     VDAgentMouseState last;
     int fake;
+    int coalesce;
+    int fixed_range;
+    /* Motion only mouse state not sent yet, see vdagentd_uinput_flush */
+    VDAgentMouseState pending;
+    int has_pending;
 };
 
 struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     int width, int height,
     struct vdagentd_guest_xorg_resolution *screen_info, int screen_count,
-    int debug, int fake)
+    int debug, int fake, int coalesce, int fixed_range)
 {
     struct vdagentd_uinput *uinput;
 
@@ -56,10 +68,17 @@ struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     if (!uinput)
         return NULL;
 
-    uinput->devname = devname;
-    uinput->fd      = -1; /* Gets opened by vdagentd_uinput_update_size() */
-    uinput->debug   = debug;
-    uinput->fake    = fake;
+    uinput->devname  = devname;
+    uinput->fd       = -1; /* Gets opened by vdagentd_uinput_update_size() */
+    uinput->debug    = debug;
+    uinput->fake     = fake;
+    uinput->coalesce = coalesce;
+    uinput->fixed_range = fixed_range;
+#ifndef WITH_STATIC_UINPUT
+    /* The fake device of Xspice takes positions in screen pixels */
+    if (fake)
+        uinput->fixed_range = 0;
+#endif
 
     vdagentd_uinput_update_size(&uinput, width, height,
                                 screen_info, screen_count);
@@ -88,13 +107,8 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     struct vdagentd_uinput *uinput = *uinputp;
     struct uinput_user_dev device = {
         .name = "spice vdagent tablet",
-#ifdef WITH_STATIC_UINPUT
-        .absmax  [ ABS_X ] = 32767,
-        .absmax  [ ABS_Y ] = 32767,
-#else
         .absmax  [ ABS_X ] = width - 1,
         .absmax  [ ABS_Y ] = height - 1,
-#endif
     };
     int i, rc;
 
@@ -114,12 +128,18 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     uinput->width  = width;
     uinput->height = height;
 
-    if (uinput->fd != -1)
-#ifndef WITH_STATIC_UINPUT
+    /* A fixed range tablet stays as is, only the scaling changes, this
+       saves the X server from re-probing the device on each size change */
+    if (uinput->fd != -1) {
+        if (uinput->fixed_range)
+            return;
         close(uinput->fd);
-#else
-        return;
-#endif
+    }
+
+    if (uinput->fixed_range) {
+        device.absmax[ABS_X] = UINPUT_FIXED_RANGE_MAX;
+        device.absmax[ABS_Y] = UINPUT_FIXED_RANGE_MAX;
+    }
 
     uinput->fd = open(uinput->devname, uinput->fake ? O_WRONLY : O_RDWR);
     if (uinput->fd == -1) {
@@ -145,10 +165,20 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     ioctl(uinput->fd, UI_SET_KEYBIT, BTN_LEFT);
     ioctl(uinput->fd, UI_SET_KEYBIT, BTN_MIDDLE);
     ioctl(uinput->fd, UI_SET_KEYBIT, BTN_RIGHT);
+#if HAVE_DECL_VD_AGENT_SBUTTON_MASK
+    ioctl(uinput->fd, UI_SET_KEYBIT, BTN_SIDE);
+#endif
+#if HAVE_DECL_VD_AGENT_EBUTTON_MASK
+    ioctl(uinput->fd, UI_SET_KEYBIT, BTN_EXTRA);
+#endif
 
-    /* wheel */
+    /* wheel, with the high resolution wheel too, so that the desktop does
+       not need to guess whether to scroll smoothly */
     ioctl(uinput->fd, UI_SET_EVBIT, EV_REL);
     ioctl(uinput->fd, UI_SET_RELBIT, REL_WHEEL);
+#if HAVE_DECL_REL_WHEEL_HI_RES
+    ioctl(uinput->fd, UI_SET_RELBIT, REL_WHEEL_HI_RES);
+#endif
 
     /* abs ptr */
     ioctl(uinput->fd, UI_SET_EVBIT, EV_ABS);
@@ -162,28 +192,40 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     }
 }
 
-static void uinput_send_event(struct vdagentd_uinput **uinputp,
+/* The events for one mouse state get collected and written at once */
+struct uinput_events {
+    struct input_event events[16];
+    int count;
+};
+
+static void uinput_add_event(struct uinput_events *events,
     __u16 type, __u16 code, __s32 value)
+{
+    struct input_event *event = &events->events[events->count++];
+
+    memset(event, 0, sizeof(*event));
+    event->type  = type;
+    event->code  = code;
+    event->value = value;
+}
+
+static void uinput_send_events(struct vdagentd_uinput **uinputp,
+    struct uinput_events *events)
 {
     struct vdagentd_uinput *uinput = *uinputp;
-    struct input_event event = {
-        .type  = type,
-        .code  = code,
-        .value = value,
-    };
-    int rc;
+    ssize_t size = events->count * sizeof(struct input_event);
 
-    rc = write(uinput->fd, &event, sizeof(event));
-    if (rc != sizeof(event)) {
+    if (write(uinput->fd, events->events, size) != size) {
         syslog(LOG_ERR, "write %s: %m", uinput->devname);
         vdagentd_uinput_destroy(uinputp);
     }
 }
 
-void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
+static void uinput_send_mouse(struct vdagentd_uinput **uinputp,
         VDAgentMouseState *mouse)
 {
     struct vdagentd_uinput *uinput = *uinputp;
+    struct uinput_events events;
     struct button_s {
         const char *name;
         int mask;
@@ -193,6 +235,12 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         { .name = "left",   .mask =  VD_AGENT_LBUTTON_MASK, .btn = BTN_LEFT      },
         { .name = "middle", .mask =  VD_AGENT_MBUTTON_MASK, .btn = BTN_MIDDLE    },
         { .name = "right",  .mask =  VD_AGENT_RBUTTON_MASK, .btn = BTN_RIGHT     },
+#if HAVE_DECL_VD_AGENT_SBUTTON_MASK
+        { .name = "side",   .mask =  VD_AGENT_SBUTTON_MASK, .btn = BTN_SIDE      },
+#endif
+#if HAVE_DECL_VD_AGENT_EBUTTON_MASK
+        { .name = "extra",  .mask =  VD_AGENT_EBUTTON_MASK, .btn = BTN_EXTRA     },
+#endif
     };
     static const struct button_s wheel[] = {
         { .name = "up",     .mask =  VD_AGENT_UBUTTON_MASK, .btn = 1  },
@@ -200,34 +248,18 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
     };
     int i, down;
 
-    if (*uinputp) {
-        if (mouse->display_id >= uinput->screen_count) {
-            syslog(LOG_WARNING, "mouse event for unknown monitor (%d >= %d)",
-                   mouse->display_id, uinput->screen_count);
-            return;
-        }
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
-                   mouse->x, mouse->y);
-        mouse->x += uinput->screen_info[mouse->display_id].x;
-        mouse->y += uinput->screen_info[mouse->display_id].y;
-#ifdef WITH_STATIC_UINPUT
-        mouse->x = mouse->x * 32767 / (uinput->width - 1);
-        mouse->y = mouse->y * 32767 / (uinput->height - 1);
-#endif
-    }
-
-    if (*uinputp && uinput->last.x != mouse->x) {
+    events.count = 0;
+    if (uinput->last.x != mouse->x) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-x %d", mouse->x);
-        uinput_send_event(uinputp, EV_ABS, ABS_X, mouse->x);
+        uinput_add_event(&events, EV_ABS, ABS_X, mouse->x);
     }
-    if (*uinputp && uinput->last.y != mouse->y) {
+    if (uinput->last.y != mouse->y) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-y %d", mouse->y);
-        uinput_send_event(uinputp, EV_ABS, ABS_Y, mouse->y);
+        uinput_add_event(&events, EV_ABS, ABS_Y, mouse->y);
     }
-    for (i = 0; i < sizeof(btns)/sizeof(btns[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(btns)/sizeof(btns[0]); i++) {
         if ((uinput->last.buttons & btns[i].mask) ==
                 (mouse->buttons & btns[i].mask))
             continue;
@@ -235,25 +267,77 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: btn-%s %s",
                     btns[i].name, down ? "down" : "up");
-        uinput_send_event(uinputp, EV_KEY, btns[i].btn, down);
+        uinput_add_event(&events, EV_KEY, btns[i].btn, down);
     }
-    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]); i++) {
         if ((uinput->last.buttons & wheel[i].mask) ==
                 (mouse->buttons & wheel[i].mask))
             continue;
         if (mouse->buttons & wheel[i].mask) {
             if (uinput->debug)
                 syslog(LOG_DEBUG, "mouse: wheel-%s", wheel[i].name);
-            uinput_send_event(uinputp, EV_REL, REL_WHEEL, wheel[i].btn);
+            uinput_add_event(&events, EV_REL, REL_WHEEL, wheel[i].btn);
+#if HAVE_DECL_REL_WHEEL_HI_RES
+            uinput_add_event(&events, EV_REL, REL_WHEEL_HI_RES,
+                             wheel[i].btn * WHEEL_HI_RES_PER_NOTCH);
+#endif
         }
     }
 
-    if (*uinputp) {
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse: syn");
-        uinput_send_event(uinputp, EV_SYN, SYN_REPORT, 0);
-    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse: syn");
+    uinput_add_event(&events, EV_SYN, SYN_REPORT, 0);
 
+    uinput_send_events(uinputp, &events);
     if (*uinputp)
         uinput->last = *mouse;
 }
+
+void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
+        VDAgentMouseState *mouse)
+{
+    struct vdagentd_uinput *uinput = *uinputp;
+
+    if (!uinput)
+        return;
+
+    if (mouse->display_id >= uinput->screen_count) {
+        syslog(LOG_WARNING, "mouse event for unknown monitor (%d >= %d)",
+               mouse->display_id, uinput->screen_count);
+        return;
+    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
+               mouse->x, mouse->y);
+    mouse->x += uinput->screen_info[mouse->display_id].x;
+    mouse->y += uinput->screen_info[mouse->display_id].y;
+    if (uinput->fixed_range && uinput->width > 1 && uinput->height > 1) {
+        mouse->x = (int64_t)mouse->x * UINPUT_FIXED_RANGE_MAX /
+                   (uinput->width - 1);
+        mouse->y = (int64_t)mouse->y * UINPUT_FIXED_RANGE_MAX /
+                   (uinput->height - 1);
+    }
+
+    /* A state which only moves the pointer gets held back, if another one
+       follows before the next flush, only the last position is sent. Any
+       other state is sent right away, it carries the latest position too. */
+    if (uinput->coalesce && mouse->buttons == uinput->last.buttons) {
+        uinput->pending = *mouse;
+        uinput->has_pending = 1;
+        return;
+    }
+
+    uinput->has_pending = 0;
+    uinput_send_mouse(uinputp, mouse);
+}
+
+void vdagentd_uinput_flush(struct vdagentd_uinput **uinputp)
+{
+    struct vdagentd_uinput *uinput = *uinputp;
+
+    if (!uinput || !uinput->has_pending)
+        return;
+
+    uinput->has_pending = 0;
+    uinput_send_mouse(uinputp, &uinput->pending);
+}
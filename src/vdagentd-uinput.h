@@ -30,11 +30,17 @@ struct vdagentd_uinput;
 struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     int width, int height,
     struct vdagentd_guest_xorg_resolution *screen_info, int screen_count,
-    int debug, int fake);
+    int debug, int fake, int coalesce, int fixed_range);
 void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp);
 
 void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         VDAgentMouseState *mouse);
+/* When coalescing, mouse states which only move the pointer are held back
+   until this gets called, so that of a burst of them only the last one gets
+   sent. Call this once done handling the input read at once. */
+void vdagentd_uinput_flush(struct vdagentd_uinput **uinputp);
+/* With fixed_range the tablet has a fixed coordinate range, positions get
+   scaled to it, so it does not need to be re-created on a size change. */
 void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         int width, int height,
         struct vdagentd_guest_xorg_resolution *screen_info,
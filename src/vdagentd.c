@@ -29,12 +29,16 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <syslog.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <spice/vd_agent.h>
 #include <glib.h>
+#ifdef WITH_CLIPBOARD_LZ4
+#include <lz4frame.h>
+#endif
 
 #include "udscs.h"
 #include "vdagentd-proto.h"
@@ -51,6 +55,38 @@ struct agent_data {
     int height;
     struct vdagentd_guest_xorg_resolution *screen_info;
     int screen_count;
+    uint32_t file_xfer_unacked;
+};
+
+/* Guest -> client file xfer data gets acked to the agent once it is queued
+   for the client, but only while there is less then this much queued up
+   for the virtio port, this way the agent sends at the speed of the channel */
+#define FILE_XFER_QUEUE_LIMIT (1024 * 1024)
+
+/* Large client clipboard data gets passed on to the agent in chunks of at
+   least this size while it is still coming in over the virtio port */
+#define CLIENT_CLIPBOARD_CHUNK_SIZE (256 * 1024)
+
+/* Active session changes get applied this long (in us) after the first one
+   is seen, so that a burst of changes, such as a quick switch away and back,
+   results in at most one change of the agent we talk to */
+#define SESSION_CHANGE_DELAY (100 * 1000)
+
+/* Compressed client clipboard data may not decompress to more than this */
+#define CLIPBOARD_DECOMPRESS_MAX_SIZE (256 * 1024 * 1024)
+
+/* Guest clipboard data which the agent streams to us in chunks, this gets
+   assembled directly into a buffer for vdagent_virtio_port_write_buf, so
+   that it does not need to be copied once more when complete */
+struct clipboard_stream {
+    int active;
+    int discard;
+    uint8_t selection;
+    uint32_t type;
+    uint8_t *buf;
+    uint32_t prefix; /* bytes in buf before the clipboard data */
+    uint32_t size;   /* bytes of clipboard data received */
+    uint32_t space;  /* bytes of clipboard data buf has room for */
 };
 
 /* variables */
@@ -60,10 +96,15 @@ static const char *vdagentd_socket = VDAGENTD_SOCKET;
 static const char *uinput_device = "/dev/uinput";
 static int debug = 0;
 static int uinput_fake = 0;
+static int uinput_coalesce = 1;
+static int uinput_fixed_range = 0;
 static int only_once = 0;
 static struct udscs_server *server = NULL;
 static struct vdagent_virtio_port *virtio_port = NULL;
 static GHashTable *active_xfers = NULL;
+/* GSList of agent connections by session id, so that finding the agent of
+   the active session does not require walking all connections */
+static GHashTable *session_agents = NULL;
 static struct session_info *session_info = NULL;
 static struct vdagentd_uinput *uinput = NULL;
 static VDAgentMonitorsConfig *mon_config = NULL;
@@ -77,9 +118,165 @@ static int quit = 0;
 static int retval = 0;
 static int client_connected = 0;
 static int max_clipboard = -1;
+/* Monotonic time at which to apply a pending active session change, or 0 */
+static gint64 session_change_time = 0;
+static struct clipboard_stream clipboard_stream = { 0, };
+/* Bytes of the client clipboard message being received which have already
+   been passed on to the agent in chunks, and for which selection */
+static uint32_t client_clipboard_sent = 0;
+static uint8_t client_clipboard_selection = 0;
+static uint32_t file_xfer_unacked = 0;
 static port_forwarder *pf = NULL;
 
 /* utility functions */
+static void clipboard_stream_reset(void)
+{
+    free(clipboard_stream.buf);
+    memset(&clipboard_stream, 0, sizeof(clipboard_stream));
+}
+
+/* When the client supports it, the data of VD_AGENT_CLIPBOARD messages in
+   both directions is a single lz4 frame, except when there is no data. Only
+   the agent channel is compressed, the udscs connection to the agent is
+   local and gains nothing from it. */
+#ifdef WITH_CLIPBOARD_LZ4
+static int clipboard_compressed(void)
+{
+    return VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                   VD_AGENT_CAP_CLIPBOARD_LZ4);
+}
+
+static uint8_t *clipboard_compress(const uint8_t *data, uint32_t size,
+    uint32_t *size_ret)
+{
+    LZ4F_preferences_t prefs;
+    uint8_t *buf;
+    size_t bound, ret;
+
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.frameInfo.contentSize = size;
+
+    bound = LZ4F_compressFrameBound(size, &prefs);
+    if (bound > UINT32_MAX) {
+        syslog(LOG_ERR, "clipboard data too large to compress");
+        return NULL;
+    }
+    buf = malloc(bound);
+    if (!buf) {
+        syslog(LOG_ERR, "out of memory compressing clipboard data");
+        return NULL;
+    }
+
+    ret = LZ4F_compressFrame(buf, bound, data, size, &prefs);
+    if (LZ4F_isError(ret)) {
+        syslog(LOG_ERR, "error compressing clipboard data: %s",
+               LZ4F_getErrorName(ret));
+        free(buf);
+        return NULL;
+    }
+
+    if (debug)
+        syslog(LOG_DEBUG, "compressed clipboard data %u -> %u bytes",
+               size, (uint32_t)ret);
+    *size_ret = ret;
+    return buf;
+}
+
+static uint8_t *clipboard_decompress(const uint8_t *data, uint32_t size,
+    uint32_t *size_ret)
+{
+    LZ4F_decompressionContext_t ctx;
+    LZ4F_frameInfo_t info;
+    uint8_t *buf = NULL, *new_buf;
+    size_t ret, in_size, out_size, in_pos, used = 0;
+    uint64_t space;
+
+    ret = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
+    if (LZ4F_isError(ret)) {
+        syslog(LOG_ERR, "error creating lz4 decompression context: %s",
+               LZ4F_getErrorName(ret));
+        return NULL;
+    }
+
+    in_size = size;
+    ret = LZ4F_getFrameInfo(ctx, &info, data, &in_size);
+    if (LZ4F_isError(ret))
+        goto error;
+    in_pos = in_size;
+
+    /* Frames without a content size get a buffer which grows as needed */
+    space = info.contentSize ? info.contentSize : (uint64_t)size * 4;
+    if (space > CLIPBOARD_DECOMPRESS_MAX_SIZE)
+        goto too_large;
+    buf = malloc(space);
+    if (!buf)
+        goto oom;
+
+    while (ret != 0) {
+        in_size = size - in_pos;
+        out_size = space - used;
+        ret = LZ4F_decompress(ctx, buf + used, &out_size,
+                              data + in_pos, &in_size, NULL);
+        if (LZ4F_isError(ret))
+            goto error;
+        in_pos += in_size;
+        used += out_size;
+        if (ret == 0 || in_size || out_size)
+            continue;
+
+        /* No progress, either we are out of room or out of data */
+        if (in_pos == size) {
+            syslog(LOG_ERR, "truncated compressed clipboard data");
+            goto exit;
+        }
+        if (space == CLIPBOARD_DECOMPRESS_MAX_SIZE)
+            goto too_large;
+        space *= 2;
+        if (space > CLIPBOARD_DECOMPRESS_MAX_SIZE)
+            space = CLIPBOARD_DECOMPRESS_MAX_SIZE;
+        new_buf = realloc(buf, space);
+        if (!new_buf)
+            goto oom;
+        buf = new_buf;
+    }
+
+    LZ4F_freeDecompressionContext(ctx);
+    *size_ret = used;
+    return buf;
+
+error:
+    syslog(LOG_ERR, "error decompressing clipboard data: %s",
+           LZ4F_getErrorName(ret));
+    goto exit;
+too_large:
+    syslog(LOG_WARNING, "compressed clipboard data is too large, discarding");
+    goto exit;
+oom:
+    syslog(LOG_ERR, "out of memory decompressing clipboard data");
+exit:
+    LZ4F_freeDecompressionContext(ctx);
+    free(buf);
+    return NULL;
+}
+#else
+static int clipboard_compressed(void)
+{
+    return 0;
+}
+
+static uint8_t *clipboard_compress(const uint8_t *data, uint32_t size,
+    uint32_t *size_ret)
+{
+    return NULL;
+}
+
+static uint8_t *clipboard_decompress(const uint8_t *data, uint32_t size,
+    uint32_t *size_ret)
+{
+    return NULL;
+}
+#endif
+
 /* vdagentd <-> spice-client communication handling */
 static void send_capabilities(struct vdagent_virtio_port *vport,
     uint32_t request)
@@ -105,6 +302,9 @@ static void send_capabilities(struct vdagent_virtio_port *vport,
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MAX_CLIPBOARD);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_AUDIO_VOLUME_SYNC);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_PORT_FORWARDING);
+#ifdef WITH_CLIPBOARD_LZ4
+    VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_LZ4);
+#endif
 
     vdagent_virtio_port_write(vport, VDP_CLIENT_PORT,
                               VD_AGENT_ANNOUNCE_CAPABILITIES, 0,
@@ -114,6 +314,8 @@ static void send_capabilities(struct vdagent_virtio_port *vport,
 
 static void do_client_disconnect(void)
 {
+    clipboard_stream_reset();
+    client_clipboard_sent = 0;
     if (client_connected) {
         udscs_server_write_all(server, VDAGENTD_CLIENT_DISCONNECTED, 0, 0,
                                NULL, 0);
@@ -206,6 +408,7 @@ static void do_client_clipboard(struct vdagent_virtio_port *vport,
 {
     uint32_t msg_type = 0, data_type = 0, size = message_header->size;
     uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+    uint8_t *decompressed = NULL;
 
     if (!active_session_conn) {
         syslog(LOG_WARNING,
@@ -240,6 +443,27 @@ static void do_client_clipboard(struct vdagent_virtio_port *vport,
         data_type = clipboard->type;
         size = size - sizeof(VDAgentClipboard);
         data = clipboard->data;
+        /* Skip what has already been passed on in chunks */
+        if (size < client_clipboard_sent) {
+            syslog(LOG_ERR, "client clipboard data smaller than what was "
+                   "already passed on, dropping it");
+            client_clipboard_sent = 0;
+            data_type = VD_AGENT_CLIPBOARD_NONE;
+            data = NULL;
+            size = 0;
+            break;
+        }
+        data += client_clipboard_sent;
+        size -= client_clipboard_sent;
+        client_clipboard_sent = 0;
+        if (clipboard_compressed() && size) {
+            decompressed = clipboard_decompress(data, size, &size);
+            if (!decompressed) {
+                data_type = VD_AGENT_CLIPBOARD_NONE;
+                size = 0;
+            }
+            data = decompressed;
+        }
         break;
     }
     case VD_AGENT_CLIPBOARD_RELEASE:
@@ -251,6 +475,47 @@ static void do_client_clipboard(struct vdagent_virtio_port *vport,
 
     udscs_write(active_session_conn, msg_type, selection, data_type,
                 data, size);
+    free(decompressed);
+}
+
+/* Pass on large client clipboard data to the agent while it is coming in,
+   so that the agent can start serving it to guest apps before it is complete.
+   The final part gets passed on by do_client_clipboard. */
+static void virtio_port_read_partial(struct vdagent_virtio_port *vport,
+    int port_nr, VDAgentMessage *message_header, uint8_t *data,
+    uint32_t data_pos)
+{
+    uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+    uint32_t prefix = sizeof(VDAgentClipboard);
+    VDAgentClipboard *clipboard;
+
+    /* Compressed data can only be passed on once complete */
+    if (port_nr != VDP_CLIENT_PORT ||
+            message_header->protocol != VD_AGENT_PROTOCOL ||
+            message_header->type != VD_AGENT_CLIPBOARD ||
+            message_header->size <= 2 * CLIENT_CLIPBOARD_CHUNK_SIZE ||
+            !active_session_conn || clipboard_compressed())
+        return;
+
+    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                VD_AGENT_CAP_CLIPBOARD_SELECTION))
+        prefix += 4;
+
+    if (data_pos < prefix ||
+            data_pos - prefix - client_clipboard_sent <
+                CLIENT_CLIPBOARD_CHUNK_SIZE)
+        return;
+
+    if (prefix > sizeof(VDAgentClipboard))
+        selection = data[0];
+
+    clipboard = (VDAgentClipboard *)(data + prefix - sizeof(VDAgentClipboard));
+    udscs_write(active_session_conn, VDAGENTD_CLIPBOARD_DATA_CHUNK,
+                selection, clipboard->type,
+                clipboard->data + client_clipboard_sent,
+                data_pos - prefix - client_clipboard_sent);
+    client_clipboard_sent = data_pos - prefix;
+    client_clipboard_selection = selection;
 }
 
 /* To be used by vdagentd for failures in file-xfer such as when file-xfer was
@@ -318,6 +583,117 @@ static void do_client_file_xfer(struct vdagent_virtio_port *vport,
         return;
     }
     udscs_write(conn, msg_type, 0, 0, data, message_header->size);
+
+    /* For guest started xfers the client's status ends the xfer */
+    if (msg_type == VDAGENTD_FILE_XFER_STATUS &&
+            (id & VDAGENTD_FILE_XFER_GUEST_ID) &&
+            ((VDAgentFileXferStatusMessage *)data)->result !=
+                VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
+        g_hash_table_remove(active_xfers, GUINT_TO_POINTER(id));
+}
+
+static void do_agent_file_xfer_status(struct udscs_connection *conn,
+    VDAgentFileXferStatusMessage *status)
+{
+    vdagent_virtio_port_write(virtio_port, VDP_CLIENT_PORT,
+                              VD_AGENT_FILE_XFER_STATUS, 0,
+                              (uint8_t *)status, sizeof(*status));
+    if (status->result == VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
+        g_hash_table_insert(active_xfers, GUINT_TO_POINTER(status->id), conn);
+    else
+        g_hash_table_remove(active_xfers, GUINT_TO_POINTER(status->id));
+}
+
+/* Stock clients ignore a file-xfer start coming from the guest, only send
+   these to clients which announce that they accept them */
+static int client_accepts_guest_file_xfers(void)
+{
+#if HAVE_DECL_VD_AGENT_CAP_FILE_XFER_FROM_GUEST
+    return VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                   VD_AGENT_CAP_FILE_XFER_FROM_GUEST);
+#else
+    return 0;
+#endif
+}
+
+static void do_agent_file_xfer(struct udscs_connection *conn,
+    struct udscs_message_header *header, uint8_t *data)
+{
+    struct agent_data *agent_data = udscs_get_user_data(conn);
+
+    switch (header->type) {
+    case VDAGENTD_FILE_XFER_START: {
+        VDAgentFileXferStartMessage *s = (VDAgentFileXferStartMessage *)data;
+        VDAgentFileXferStatusMessage status;
+
+        if (header->size <= sizeof(*s) ||
+                !(s->id & VDAGENTD_FILE_XFER_GUEST_ID)) {
+            syslog(LOG_ERR, "invalid file-xfer start from agent, ignoring");
+            return;
+        }
+        if (conn != active_session_conn || !client_connected ||
+                !client_accepts_guest_file_xfers() ||
+                (session_info &&
+                 session_info_session_is_locked(session_info))) {
+            syslog(LOG_WARNING, "refusing guest file-xfer %u from inactive "
+                   "or locked session, or to a client not accepting it",
+                   s->id);
+            status.id = s->id;
+            status.result = VD_AGENT_FILE_XFER_STATUS_ERROR;
+            udscs_write(conn, VDAGENTD_FILE_XFER_STATUS, 0, 0,
+                        (uint8_t *)&status, sizeof(status));
+            return;
+        }
+        g_hash_table_insert(active_xfers, GUINT_TO_POINTER(s->id), conn);
+        vdagent_virtio_port_write(virtio_port, VDP_CLIENT_PORT,
+                                  VD_AGENT_FILE_XFER_START, 0,
+                                  data, header->size);
+        break;
+    }
+    case VDAGENTD_FILE_XFER_DATA: {
+        VDAgentFileXferDataMessage *d = (VDAgentFileXferDataMessage *)data;
+
+        if (header->size < sizeof(*d) ||
+                header->size - sizeof(*d) != d->size) {
+            syslog(LOG_ERR, "invalid file-xfer data from agent, ignoring");
+            return;
+        }
+        /* Cancelled xfers still get acked, the agent learns about the
+           cancellation through the status message */
+        if (g_hash_table_lookup(active_xfers,
+                                GUINT_TO_POINTER(d->id)) == conn)
+            vdagent_virtio_port_write(virtio_port, VDP_CLIENT_PORT,
+                                      VD_AGENT_FILE_XFER_DATA, 0,
+                                      data, header->size);
+        agent_data->file_xfer_unacked++;
+        file_xfer_unacked++;
+        break;
+    }
+    }
+}
+
+static int send_file_xfer_data_ack(struct udscs_connection **connp,
+    void *priv)
+{
+    struct agent_data *agent_data = udscs_get_user_data(*connp);
+
+    if (agent_data->file_xfer_unacked) {
+        udscs_write(*connp, VDAGENTD_FILE_XFER_DATA_ACK,
+                    agent_data->file_xfer_unacked, 0, NULL, 0);
+        file_xfer_unacked -= agent_data->file_xfer_unacked;
+        agent_data->file_xfer_unacked = 0;
+    }
+    return 0;
+}
+
+static void send_file_xfer_data_acks(void)
+{
+    if (!file_xfer_unacked || (virtio_port &&
+            vdagent_virtio_port_get_write_queue_size(virtio_port) >
+                FILE_XFER_QUEUE_LIMIT))
+        return;
+
+    udscs_server_for_all_clients(server, send_file_xfer_data_ack, NULL);
 }
 
 static int virtio_port_read_complete(
@@ -330,7 +706,7 @@ static int virtio_port_read_complete(
 
     if (message_header->protocol != VD_AGENT_PROTOCOL) {
         syslog(LOG_ERR, "message with wrong protocol version ignoring");
-        return 0;
+        goto exit;
     }
 
     switch (message_header->type) {
@@ -349,7 +725,9 @@ static int virtio_port_read_complete(
                                                 agent_data->screen_info,
                                                 agent_data->screen_count,
                                                 debug > 1,
-                                                uinput_fake);
+                                                uinput_fake,
+                                                uinput_coalesce,
+                                                uinput_fixed_range);
             if (!uinput) {
                 syslog(LOG_CRIT, "Fatal uinput error");
                 retval = 1;
@@ -426,20 +804,41 @@ static int virtio_port_read_complete(
         syslog(LOG_WARNING, "unknown message type %d, ignoring",
                message_header->type);
     }
-
-    return 0;
+    goto exit;
 
 size_error:
     syslog(LOG_ERR, "read: invalid message size: %u for message type: %u",
            message_header->size, message_header->type);
+exit:
+    /* Whatever happened to the message, data passed on in chunks by
+       virtio_port_read_partial was only for this message */
+    if (port_nr == VDP_CLIENT_PORT && client_clipboard_sent) {
+        if (active_session_conn)
+            udscs_write(active_session_conn, VDAGENTD_CLIPBOARD_DATA,
+                        client_clipboard_selection,
+                        VD_AGENT_CLIPBOARD_NONE, NULL, 0);
+        client_clipboard_sent = 0;
+    }
     return 0;
 }
 
 static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
     uint32_t data_type, const uint8_t *data, uint32_t data_size)
 {
-    uint32_t size = data_size;
+    uint8_t *compressed = NULL;
+    uint32_t size;
 
+    if (msg_type == VD_AGENT_CLIPBOARD && data_size &&
+            clipboard_compressed()) {
+        compressed = clipboard_compress(data, data_size, &data_size);
+        if (!compressed) {
+            data_type = VD_AGENT_CLIPBOARD_NONE;
+            data_size = 0;
+        }
+        data = compressed;
+    }
+
+    size = data_size;
     if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                 VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
         size += 4;
@@ -461,9 +860,118 @@ static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
     }
 
     vdagent_virtio_port_write_append(virtio_port, data, data_size);
+    free(compressed);
 }
 
 /* vdagentd <-> vdagent communication handling */
+static void clipboard_stream_append(const uint8_t *data, uint32_t size)
+{
+    uint8_t *new_buf;
+    uint64_t new_size = (uint64_t)clipboard_stream.size + size;
+    uint64_t space;
+
+    if (clipboard_stream.discard)
+        return;
+
+    if ((max_clipboard != -1 && new_size > max_clipboard) ||
+            new_size > UINT32_MAX - clipboard_stream.prefix) {
+        syslog(LOG_WARNING, "clipboard is too large (%" PRIu64 " bytes), "
+               "discarding", new_size);
+        goto discard;
+    }
+
+    if (new_size > clipboard_stream.space) {
+        /* Grow geometrically to avoid copying the data over and over */
+        space = (uint64_t)clipboard_stream.space * 2;
+        if (space < new_size)
+            space = new_size;
+        if (space > UINT32_MAX - clipboard_stream.prefix)
+            space = UINT32_MAX - clipboard_stream.prefix;
+        new_buf = realloc(clipboard_stream.buf, clipboard_stream.prefix + space);
+        if (!new_buf) {
+            syslog(LOG_ERR, "out of memory assembling clipboard data");
+            goto discard;
+        }
+        clipboard_stream.buf = new_buf;
+        clipboard_stream.space = space;
+    }
+
+    memcpy(clipboard_stream.buf + clipboard_stream.prefix +
+           clipboard_stream.size, data, size);
+    clipboard_stream.size = new_size;
+    return;
+
+discard:
+    free(clipboard_stream.buf);
+    clipboard_stream.buf = NULL;
+    clipboard_stream.discard = 1;
+}
+
+static void do_agent_clipboard_chunk(uint8_t selection, uint32_t type,
+    const uint8_t *data, uint32_t size)
+{
+    if (clipboard_stream.active && (clipboard_stream.selection != selection ||
+                                    clipboard_stream.type != type)) {
+        syslog(LOG_WARNING, "clipboard data chunk for a different selection "
+               "or type, discarding earlier chunks");
+        clipboard_stream_reset();
+    }
+
+    if (!clipboard_stream.active) {
+        clipboard_stream.active = 1;
+        clipboard_stream.selection = selection;
+        clipboard_stream.type = type;
+        clipboard_stream.prefix = VDAGENT_VIRTIO_PORT_HEADER_SIZE + 4;
+        if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                    VD_AGENT_CAP_CLIPBOARD_SELECTION))
+            clipboard_stream.prefix += 4;
+    }
+
+    clipboard_stream_append(data, size);
+}
+
+static void do_agent_clipboard_stream_end(const uint8_t *data, uint32_t size)
+{
+    uint8_t *p;
+
+    clipboard_stream_append(data, size);
+    if (clipboard_stream.discard) {
+        virtio_write_clipboard(clipboard_stream.selection, VD_AGENT_CLIPBOARD,
+                               clipboard_stream.type, NULL, 0);
+        clipboard_stream_reset();
+        return;
+    }
+
+    if (clipboard_compressed()) {
+        virtio_write_clipboard(clipboard_stream.selection, VD_AGENT_CLIPBOARD,
+                               clipboard_stream.type,
+                               clipboard_stream.buf + clipboard_stream.prefix,
+                               clipboard_stream.size);
+        clipboard_stream_reset();
+        return;
+    }
+
+    p = clipboard_stream.buf + VDAGENT_VIRTIO_PORT_HEADER_SIZE;
+    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
+        uint8_t sel[4] = { clipboard_stream.selection, 0, 0, 0 };
+        memcpy(p, sel, 4);
+        p += 4;
+    }
+    memcpy(p, &clipboard_stream.type, 4);
+
+    if (vdagent_virtio_port_write_buf(virtio_port, VDP_CLIENT_PORT,
+            VD_AGENT_CLIPBOARD, 0, clipboard_stream.buf,
+            clipboard_stream.prefix - VDAGENT_VIRTIO_PORT_HEADER_SIZE +
+            clipboard_stream.size) == 0) {
+        /* The port owns the buffer now */
+        clipboard_stream.buf = NULL;
+    } else {
+        syslog(LOG_ERR, "out of memory queuing clipboard data");
+    }
+    clipboard_stream_reset();
+}
+
 static int do_agent_clipboard(struct udscs_connection *conn,
         struct udscs_message_header *header, const uint8_t *data)
 {
@@ -494,6 +1002,9 @@ static int do_agent_clipboard(struct udscs_connection *conn,
     }
 
     switch (header->type) {
+    case VDAGENTD_CLIPBOARD_DATA_CHUNK:
+        do_agent_clipboard_chunk(selection, header->arg2, data, header->size);
+        return 0;
     case VDAGENTD_CLIPBOARD_GRAB:
         msg_type = VD_AGENT_CLIPBOARD_GRAB;
         agent_owns_clipboard[selection] = 1;
@@ -504,6 +1015,15 @@ static int do_agent_clipboard(struct udscs_connection *conn,
         size = 0;
         break;
     case VDAGENTD_CLIPBOARD_DATA:
+        if (clipboard_stream.active) {
+            if (clipboard_stream.selection == selection &&
+                    clipboard_stream.type == header->arg2) {
+                do_agent_clipboard_stream_end(data, header->size);
+                return 0;
+            }
+            /* Streaming got aborted, this is the agent telling us so */
+            clipboard_stream_reset();
+        }
         msg_type = VD_AGENT_CLIPBOARD;
         data_type = header->arg2;
         if (max_clipboard != -1 && size > max_clipboard) {
@@ -561,7 +1081,9 @@ static void check_xorg_resolution(void)
                                             agent_data->screen_info,
                                             agent_data->screen_count,
                                             debug > 1,
-                                            uinput_fake);
+                                            uinput_fake,
+                                            uinput_coalesce,
+                                            uinput_fixed_range);
         else
             vdagentd_uinput_update_size(&uinput,
                                         agent_data->width,
@@ -586,6 +1108,8 @@ static void check_xorg_resolution(void)
                 quit = 1;
                 return;
             }
+            vdagent_virtio_port_set_partial_read_callback(virtio_port,
+                                                    virtio_port_read_partial);
             send_capabilities(virtio_port, 1);
         }
     } else {
@@ -600,20 +1124,25 @@ static void check_xorg_resolution(void)
     }
 }
 
-static int connection_matches_active_session(struct udscs_connection **connp,
-    void *priv)
+static void session_agents_add(struct udscs_connection *conn,
+    const char *session)
 {
-    struct udscs_connection **conn_ret = (struct udscs_connection **)priv;
-    struct agent_data *agent_data = udscs_get_user_data(*connp);
+    GSList *conns = g_hash_table_lookup(session_agents, session);
 
-    /* Check if this connection matches the currently active session */
-    if (!agent_data->session || !active_session)
-        return 0;
-    if (strcmp(agent_data->session, active_session))
-        return 0;
+    conns = g_slist_prepend(conns, conn);
+    g_hash_table_replace(session_agents, g_strdup(session), conns);
+}
 
-    *conn_ret = *connp;
-    return 1;
+static void session_agents_remove(struct udscs_connection *conn,
+    const char *session)
+{
+    GSList *conns = g_hash_table_lookup(session_agents, session);
+
+    conns = g_slist_remove(conns, conn);
+    if (conns)
+        g_hash_table_replace(session_agents, g_strdup(session), conns);
+    else
+        g_hash_table_remove(session_agents, session);
 }
 
 static void release_clipboards(void)
@@ -631,13 +1160,20 @@ static void release_clipboards(void)
 
 static void update_active_session_connection(struct udscs_connection *new_conn)
 {
+    /* This applies any pending session change */
+    session_change_time = 0;
+
     if (session_info) {
+        GSList *conns = NULL;
+
         new_conn = NULL;
         if (!active_session)
             active_session = session_info_get_active_session(session_info);
-        session_count = udscs_server_for_all_clients(server,
-                                         connection_matches_active_session,
-                                         (void*)&new_conn);
+        if (active_session)
+            conns = g_hash_table_lookup(session_agents, active_session);
+        session_count = g_slist_length(conns);
+        if (conns)
+            new_conn = conns->data;
     } else {
         if (new_conn)
             session_count++;
@@ -655,6 +1191,8 @@ static void update_active_session_connection(struct udscs_connection *new_conn)
         return;
 
     active_session_conn = new_conn;
+    clipboard_stream_reset();
+    client_clipboard_sent = 0;
     if (debug)
         syslog(LOG_DEBUG, "%p is now the active session", new_conn);
 
@@ -702,6 +1240,8 @@ static void agent_connect(struct udscs_connection *conn)
     if (session_info) {
         uint32_t pid = udscs_get_peer_cred(conn).pid;
         agent_data->session = session_info_session_for_pid(session_info, pid);
+        if (agent_data->session)
+            session_agents_add(conn, agent_data->session);
     }
 
     udscs_set_user_data(conn, (void *)agent_data);
@@ -715,7 +1255,10 @@ static void agent_disconnect(struct udscs_connection *conn)
     struct agent_data *agent_data = udscs_get_user_data(conn);
 
     g_hash_table_foreach_remove(active_xfers, remove_active_xfers, conn);
+    file_xfer_unacked -= agent_data->file_xfer_unacked;
 
+    if (agent_data->session)
+        session_agents_remove(conn, agent_data->session);
     free(agent_data->session);
     agent_data->session = NULL;
     update_active_session_connection(NULL);
@@ -770,6 +1313,7 @@ static void agent_read_complete(struct udscs_connection **connp,
     case VDAGENTD_CLIPBOARD_GRAB:
     case VDAGENTD_CLIPBOARD_REQUEST:
     case VDAGENTD_CLIPBOARD_DATA:
+    case VDAGENTD_CLIPBOARD_DATA_CHUNK:
     case VDAGENTD_CLIPBOARD_RELEASE:
         if (do_agent_clipboard(*connp, header, data)) {
             udscs_destroy_connection(connp);
@@ -778,19 +1322,31 @@ static void agent_read_complete(struct udscs_connection **connp,
         }
         break;
     case VDAGENTD_FILE_XFER_STATUS:{
-        VDAgentFileXferStatusMessage status;
-        status.id = header->arg1;
-        status.result = header->arg2;
-        vdagent_virtio_port_write(virtio_port, VDP_CLIENT_PORT,
-                                  VD_AGENT_FILE_XFER_STATUS, 0,
-                                  (uint8_t *)&status, sizeof(status));
-        if (status.result == VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA)
-            g_hash_table_insert(active_xfers, GUINT_TO_POINTER(status.id),
-                                *connp);
-        else
-            g_hash_table_remove(active_xfers, GUINT_TO_POINTER(status.id));
+        VDAgentFileXferStatusMessage status, *statuses;
+        int i, n = header->size / sizeof(status);
+
+        if (header->size == 0) {
+            status.id = header->arg1;
+            status.result = header->arg2;
+            do_agent_file_xfer_status(*connp, &status);
+            break;
+        }
+        if (header->size != n * sizeof(status)) {
+            syslog(LOG_ERR, "file-xfer status message has wrong size, "
+                            "disconnecting agent");
+            udscs_destroy_connection(connp);
+            free(data);
+            return;
+        }
+        statuses = (VDAgentFileXferStatusMessage *)data;
+        for (i = 0; i < n; i++)
+            do_agent_file_xfer_status(*connp, &statuses[i]);
         break;
     }
+    case VDAGENTD_FILE_XFER_START:
+    case VDAGENTD_FILE_XFER_DATA:
+        do_agent_file_xfer(*connp, header, data);
+        break;
 
     default:
         syslog(LOG_ERR, "unknown message from vdagent: %u, ignoring",
@@ -821,6 +1377,10 @@ static void usage(FILE *fp)
             "  -S <filename>  set udcs socket [%s]\n"
             "  -u <dev>       set uinput device       [%s]\n"
             "  -f             treat uinput device as fake; no ioctls\n"
+            "  -M             send every mouse position, do not only send\n"
+            "                 the last of those read at once\n"
+            "  -T             give the uinput tablet a fixed range, so that it\n"
+            "                 is not re-created when the resolution changes\n"
             "  -x             don't daemonize\n"
             "  -o             Only handle one virtio serial session.\n"
 #ifdef HAVE_CONSOLE_KIT
@@ -861,8 +1421,10 @@ static void daemonize(void)
 static void main_loop(void)
 {
     fd_set readfds, writefds;
+    struct timeval timeout, *timeout_p;
+    gint64 now;
     int n, nfds;
-    int ck_fd = 0;
+    int ck_fd = 0, signal_fd = -1;
     int once = 0;
 
     while (!quit) {
@@ -884,9 +1446,27 @@ static void main_loop(void)
             FD_SET(ck_fd, &readfds);
             if (ck_fd >= nfds)
                 nfds = ck_fd + 1;
+            signal_fd = session_info_get_signal_fd(session_info);
+            if (signal_fd != -1) {
+                FD_SET(signal_fd, &readfds);
+                if (signal_fd >= nfds)
+                    nfds = signal_fd + 1;
+            }
         }
 
-        n = select(nfds, &readfds, &writefds, NULL, NULL);
+        timeout_p = NULL;
+        if (session_change_time) {
+            now = g_get_monotonic_time();
+            if (now >= session_change_time) {
+                update_active_session_connection(NULL);
+                continue;
+            }
+            timeout.tv_sec = (session_change_time - now) / G_USEC_PER_SEC;
+            timeout.tv_usec = (session_change_time - now) % G_USEC_PER_SEC;
+            timeout_p = &timeout;
+        }
+
+        n = select(nfds, &readfds, &writefds, NULL, timeout_p);
         if (n == -1) {
             if (errno == EINTR)
                 continue;
@@ -900,6 +1480,7 @@ static void main_loop(void)
         if (virtio_port) {
             once = 1;
             vdagent_virtio_port_handle_fds(&virtio_port, &readfds, &writefds);
+            vdagentd_uinput_flush(&uinput);
             if (!virtio_port) {
                 int old_client_connected = client_connected;
                 syslog(LOG_CRIT,
@@ -913,6 +1494,8 @@ static void main_loop(void)
                     retval = 1;
                     break;
                 }
+                vdagent_virtio_port_set_partial_read_callback(virtio_port,
+                                                    virtio_port_read_partial);
                 do_client_disconnect();
                 client_connected = old_client_connected;
             }
@@ -927,10 +1510,17 @@ static void main_loop(void)
             break;
         }
 
+        if (session_info && signal_fd != -1 && FD_ISSET(signal_fd, &readfds))
+            session_info_handle_signals(session_info);
+
         if (session_info && FD_ISSET(ck_fd, &readfds)) {
             active_session = session_info_get_active_session(session_info);
-            update_active_session_connection(NULL);
+            if (!session_change_time)
+                session_change_time = g_get_monotonic_time() +
+                                      SESSION_CHANGE_DELAY;
         }
+
+        send_file_xfer_data_acks();
     }
 }
 
@@ -947,7 +1537,7 @@ int main(int argc, char *argv[])
     struct sigaction act;
 
     for (;;) {
-        if (-1 == (c = getopt(argc, argv, "-dhxXfos:u:S:")))
+        if (-1 == (c = getopt(argc, argv, "-dhxXfMTos:u:S:")))
             break;
         switch (c) {
         case 'd':
@@ -965,6 +1555,12 @@ int main(int argc, char *argv[])
         case 'f':
             uinput_fake = 1;
             break;
+        case 'M':
+            uinput_coalesce = 0;
+            break;
+        case 'T':
+            uinput_fixed_range = 1;
+            break;
         case 'o':
             only_once = 1;
             break;
@@ -1015,8 +1611,11 @@ int main(int argc, char *argv[])
         daemonize();
 
 #ifdef WITH_STATIC_UINPUT
+    /* The static device is never re-created, so it needs a fixed range */
+    uinput_fixed_range = 1;
     uinput = vdagentd_uinput_create(uinput_device, 1024, 768, NULL, 0,
-                                    debug > 1, uinput_fake);
+                                    debug > 1, uinput_fake, uinput_coalesce,
+                                    uinput_fixed_range);
     if (!uinput) {
         udscs_destroy_server(server);
         return 1;
@@ -1034,6 +1633,8 @@ int main(int argc, char *argv[])
         syslog(LOG_WARNING, "no session info, max 1 session agent allowed");
 
     active_xfers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    session_agents = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, NULL);
     main_loop();
 
     release_clipboards();